@@ -0,0 +1,130 @@
+#!/bin/bash
+
+set -e
+
+VFS_NAME="bench_disk.vfs"
+BLOCK_SIZE=${BLOCK_SIZE:-1048576}
+FILE_BLOCKS=16
+FILES=8
+VFS_SIZE=$(expr $BLOCK_SIZE \* $FILE_BLOCKS \* $FILES \* 2)
+ROUNDS=${ROUNDS:-3}
+# Stripe members are spread over these directories, put them on separate devices
+STRIPE_DIRS=(${STRIPE_DIRS:-.})
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+prepare_inputs() {
+    for n in $(seq 1 $FILES); do
+        head -c $(expr $BLOCK_SIZE \* $FILE_BLOCKS) /dev/urandom > bench_in$n.bin
+    done
+}
+
+cleanup_inputs() {
+    rm -f bench_in*.bin bench_out*.bin
+}
+
+# Fills the disk, leaves every other file deleted so defrag has to move blocks
+run_case() {
+    local engine=$1
+    local depth=$2
+    local members=$3
+    export VFS_IO_ENGINE=$engine
+    export VFS_QUEUE_DEPTH=$depth
+
+    local stripe=""
+    if [ $members -gt 1 ]; then
+        stripe="1"
+        for m in $(seq 1 $(( members - 1 ))); do
+            stripe="$stripe ${STRIPE_DIRS[$(( m % ${#STRIPE_DIRS[@]} ))]}/bench_member$m.img"
+        done
+    fi
+    ./fs_util create $VFS_NAME $VFS_SIZE $BLOCK_SIZE $stripe > /dev/null
+    rm -f bench_out*.bin
+
+    local start=$(now_ms)
+    for n in $(seq 1 $FILES); do
+        echo "file$n" | ./fs_util $VFS_NAME cpin bench_in$n.bin > /dev/null 2>> bench_engine.log
+    done
+    local cpin_ms=$(( $(now_ms) - start ))
+
+    for n in $(seq 1 2 $FILES); do
+        ./fs_util $VFS_NAME rm file$n > /dev/null
+    done
+
+    start=$(now_ms)
+    ./fs_util $VFS_NAME defrag > /dev/null 2>> bench_engine.log
+    local defrag_ms=$(( $(now_ms) - start ))
+
+    start=$(now_ms)
+    for n in $(seq 2 2 $FILES); do
+        echo "bench_out$n.bin" | ./fs_util $VFS_NAME cpout file$n > /dev/null 2>> bench_engine.log
+    done
+    local cpout_ms=$(( $(now_ms) - start ))
+
+    for n in $(seq 2 2 $FILES); do
+        cmp -s bench_in$n.bin bench_out$n.bin || { echo "Data mismatch for file$n"; exit 1; }
+    done
+
+    ./fs_util $VFS_NAME die > /dev/null
+    # fs_util names the engine it fell back to when the requested one is missing
+    local used=$(sed -n 's/.*not available, using \([a-z]*\)$/\1/p' bench_engine.log | head -1)
+    rm -f bench_engine.log
+    printf "%-7s %6s %8s %10s %10s %10s\n" ${used:-$engine} $depth $members $cpin_ms $defrag_ms $cpout_ms
+}
+
+echo "Block size $BLOCK_SIZE bytes, $FILES files of $FILE_BLOCKS blocks, times in ms (best of $ROUNDS runs each)"
+printf "%-7s %6s %8s %10s %10s %10s\n" engine depth members cpin defrag cpout
+
+best_of_rounds() {
+    for round in $(seq 1 $ROUNDS); do
+        run_case $1 $2 $3
+    done | sort -n -k4 | head -1
+}
+
+prepare_inputs
+for engine in sync threads uring; do
+    for depth in 1 4 16 32; do
+        best_of_rounds $engine $depth 1
+    done
+done
+for members in 2 4; do
+    best_of_rounds uring 32 $members
+done
+cleanup_inputs
+
+# Small files: space used with and without inline data and tail packing, and the
+# latency of small reads through serve mode (the loadgen files are 4 KiB each)
+SMALL_BLOCK_SIZE=${SMALL_BLOCK_SIZE:-65536}
+SMALL_FILES=24
+SOCKET_PATH="bench_vfs.sock"
+
+run_small_files() {
+    export VFS_PACK_SMALL_FILES=$1
+    ./fs_util create $VFS_NAME $(expr $SMALL_BLOCK_SIZE \* 256) $SMALL_BLOCK_SIZE > /dev/null
+    for n in $(seq 1 $SMALL_FILES); do
+        if [ $(( n % 3 )) -eq 0 ]; then
+            head -c $(( RANDOM % 64 + 1 )) /dev/urandom > bench_small.bin
+        else
+            head -c $(( RANDOM % (SMALL_BLOCK_SIZE / 4) + SMALL_BLOCK_SIZE * (n % 3 - 1) + 1 )) /dev/urandom > bench_small.bin
+        fi
+        echo "small$n" | ./fs_util $VFS_NAME cpin bench_small.bin > /dev/null
+    done
+    rm -f bench_small.bin
+    echo "Packing $1: $(./fs_util $VFS_NAME analyze | grep '^Used:')"
+    ./fs_util $VFS_NAME analyze | grep '^Inline files:'
+
+    ./fs_util $VFS_NAME serve $SOCKET_PATH > /dev/null &
+    local server=$!
+    while [ ! -S $SOCKET_PATH ]; do sleep 0.1; done
+    ./fs_util loadgen $SOCKET_PATH 64 2000 4 | grep -v "error status"
+    kill -INT $server
+    wait $server
+    ./fs_util $VFS_NAME die > /dev/null
+}
+
+echo ""
+echo "Small files, block size $SMALL_BLOCK_SIZE bytes"
+run_small_files 1
+run_small_files 0
@@ -3,11 +3,48 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
-
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#if defined(__linux__) && !defined(VFS_NO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#define VFS_HAVE_URING 1
+#endif
 
 #define MAX_FILES        64
 #define INODE_BLOCK_NUM  16
 #define MAX_FILENAME_LENGTH    32
+#define MAX_BLOCK_MOVES  (MAX_FILES * INODE_BLOCK_NUM)
+
+//how an inode keeps its data: whole blocks only, inline in the inode record,
+//or whole blocks plus a tail packed into a shared fragment block
+#define STORAGE_BLOCKS   0
+#define STORAGE_INLINE   1
+#define STORAGE_TAIL     2
+#define INLINE_DATA_SIZE (INODE_BLOCK_NUM * sizeof(int))
+#define FRAGMENT_ALIGN   16
+
+#define MAX_MEMBERS            8
+#define MEMBER_PATH_LENGTH     256
+
+#define DEFAULT_QUEUE_DEPTH    32
+#define MAX_QUEUE_DEPTH        1024
+#define MAX_IO_WORKERS         64
 
 
 typedef struct {
@@ -20,6 +57,9 @@ typedef struct {
     int    bitmapSize;
     int    bitmapOffset;
     int    dataAreaOffset;
+    int    memberCount;
+    int    stripeUnit;
+    char   memberPaths[MAX_MEMBERS][MEMBER_PATH_LENGTH];
 } SuperBlock;
 
 
@@ -27,14 +67,29 @@ typedef struct {
     char fileName[MAX_FILENAME_LENGTH];  
     size_t fileSize;
     bool   isUsed;
-    int    blockIndex[INODE_BLOCK_NUM];
+    unsigned char  storage;   //STORAGE_*, both fields sit in what was padding
+    unsigned short tailSlot;  //tail position in its fragment block, in FRAGMENT_ALIGN units
+    union {
+        int           blockIndex[INODE_BLOCK_NUM];  //a tail's fragment block follows the whole blocks
+        unsigned char inlineData[INLINE_DATA_SIZE];
+    };
     int    blocksAllocated;
 } Inode;
 
 
+//precedes every tail in a fragment block so the block can be checked against the inode
+//table, which analyze does for every packed tail
+typedef struct {
+    uint16_t owner;   //inode index
+    uint16_t reserved;
+    uint32_t length;  //tail bytes that follow
+} FragmentHeader;
+
+
 //statisc
 static SuperBlock g_superBlock;
 static FILE* g_diskFile = NULL;
+static int g_memberFds[MAX_MEMBERS];
 
 
 static bool isBlockUsed(const unsigned char* bitmap, int blockIndex) {
@@ -71,241 +126,967 @@ static int findFreeBlocks(unsigned char* bitmap, int blocksCount, int countNeede
 }
 
 
-void deleteInode(Inode* inode) {
-    inode->isUsed = false;
-    inode->fileSize = 0;
-    inode->blocksAllocated = 0;
-    memset(inode->fileName, 0, MAX_FILENAME_LENGTH); 
-    memset(inode->blockIndex, 0, sizeof(inode->blockIndex)); 
+//asynchronous block I/O: io_uring when the kernel has it, otherwise a pool of threads
+//doing pread/pwrite, or the plain synchronous loop
+typedef struct {
+    bool         isWrite;
+    int          fd;
+    struct iovec iov;
+    off_t        offset;
+} IoRequest;
+
+
+typedef struct {
+    bool       useUring;
+    const char* name;
+    int        depth;
+    int        capacity;
+    int        queued;
+    IoRequest* requests;
+    //thread pool, workers claim requests [next, batch) and count them in finished
+    int             workers;
+    pthread_t       threads[MAX_IO_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  done;
+    int             batch;
+    int             next;
+    int             finished;
+    int             error;
+    bool            stopping;
+#ifdef VFS_HAVE_URING
+    int        ringFd;
+    void*      sqRing;
+    size_t     sqRingSize;
+    void*      cqRing;
+    size_t     cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t     sqesSize;
+    unsigned  *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned  *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe* cqes;
+#endif
+} IoEngine;
+
+
+typedef struct {
+    int            srcFd;
+    off_t          srcOffset;
+    int            dstFd;
+    off_t          dstOffset;
+    size_t         length;
+    unsigned char* held;
+    bool           barrier;   //starts a new window, the copy must not share one with earlier moves
+} BlockMove;
+
+
+static int finishRequest(IoRequest* req, size_t done) {
+    while (done < req->iov.iov_len) {
+        char* ptr = (char*)req->iov.iov_base + done;
+        size_t left = req->iov.iov_len - done;
+        ssize_t n = req->isWrite ? pwrite(req->fd, ptr, left, req->offset + done)
+                                 : pread(req->fd, ptr, left, req->offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 && !req->isWrite) {
+            //blocks past the end of a sparse image were never written and read as zeros
+            memset(ptr, 0, left);
+            return 0;
+        }
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
 }
 
 
-void writeSuperBlock() {
-    fseek(g_diskFile, 0, SEEK_SET);
-    fwrite(&g_superBlock, sizeof(SuperBlock), 1, g_diskFile);
-    fflush(g_diskFile);
+#ifdef VFS_HAVE_URING
+static void ioUringRelease(IoEngine* engine) {
+    if (engine->sqes) munmap(engine->sqes, engine->sqesSize);
+    if (engine->cqRing && engine->cqRing != engine->sqRing) munmap(engine->cqRing, engine->cqRingSize);
+    if (engine->sqRing) munmap(engine->sqRing, engine->sqRingSize);
+    if (engine->ringFd >= 0) close(engine->ringFd);
+    engine->sqes = NULL;
+    engine->cqRing = NULL;
+    engine->sqRing = NULL;
+    engine->ringFd = -1;
 }
 
 
-void readSuperBlock() {
-    fseek(g_diskFile, 0, SEEK_SET);
-    fread(&g_superBlock, sizeof(SuperBlock), 1, g_diskFile);
+static int ioUringSetup(IoEngine* engine, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    engine->ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (engine->ringFd < 0) {
+        return -1;
+    }
+
+    engine->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    engine->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMmap) {
+        if (engine->cqRingSize > engine->sqRingSize) engine->sqRingSize = engine->cqRingSize;
+        engine->cqRingSize = engine->sqRingSize;
+    }
+
+    engine->sqRing = mmap(NULL, engine->sqRingSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, engine->ringFd, IORING_OFF_SQ_RING);
+    if (engine->sqRing == MAP_FAILED) {
+        engine->sqRing = NULL;
+        ioUringRelease(engine);
+        return -1;
+    }
+    if (singleMmap) {
+        engine->cqRing = engine->sqRing;
+    } else {
+        engine->cqRing = mmap(NULL, engine->cqRingSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, engine->ringFd, IORING_OFF_CQ_RING);
+        if (engine->cqRing == MAP_FAILED) {
+            engine->cqRing = NULL;
+            ioUringRelease(engine);
+            return -1;
+        }
+    }
+    engine->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    engine->sqes = mmap(NULL, engine->sqesSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, engine->ringFd, IORING_OFF_SQES);
+    if (engine->sqes == MAP_FAILED) {
+        engine->sqes = NULL;
+        ioUringRelease(engine);
+        return -1;
+    }
+
+    char* sq = (char*)engine->sqRing;
+    char* cq = (char*)engine->cqRing;
+    engine->sqHead  = (unsigned*)(sq + params.sq_off.head);
+    engine->sqTail  = (unsigned*)(sq + params.sq_off.tail);
+    engine->sqMask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    engine->sqArray = (unsigned*)(sq + params.sq_off.array);
+    engine->cqHead  = (unsigned*)(cq + params.cq_off.head);
+    engine->cqTail  = (unsigned*)(cq + params.cq_off.tail);
+    engine->cqMask  = (unsigned*)(cq + params.cq_off.ring_mask);
+    engine->cqes    = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
 }
 
 
-void writeInodeArea(Inode* inodes, int count) {
-    fseek(g_diskFile, g_superBlock.inodeAreaOffset, SEEK_SET);
-    fwrite(inodes, sizeof(Inode), count, g_diskFile);
-    fflush(g_diskFile);
+static int ioUringRun(IoEngine* engine) {
+    unsigned tail = *engine->sqTail;
+    for (int i = 0; i < engine->queued; i++) {
+        IoRequest* req = &engine->requests[i];
+        unsigned index = tail & *engine->sqMask;
+        struct io_uring_sqe* sqe = &engine->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = req->isWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd        = req->fd;
+        sqe->addr      = (unsigned long)&req->iov;
+        sqe->len       = 1;
+        sqe->off       = req->offset;
+        sqe->user_data = i;
+        engine->sqArray[index] = index;
+        tail++;
+    }
+    __atomic_store_n(engine->sqTail, tail, __ATOMIC_RELEASE);
+
+    int toSubmit = engine->queued;
+    int pending = engine->queued;
+    int result = 0;
+    int error = 0;
+    while (pending > 0) {
+        int ret = (int)syscall(__NR_io_uring_enter, engine->ringFd, toSubmit, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            if (error != 0) {
+                //the ring cannot even be waited on, closing it cancels whatever is left
+                ioUringRelease(engine);
+                engine->useUring = false;
+                engine->name = "sync";
+                errno = error;
+                return -1;
+            }
+            //the caller frees the buffers once this returns, so take back what the kernel
+            //has not picked up yet and wait for everything it has
+            error = errno;
+            unsigned consumed = __atomic_load_n(engine->sqHead, __ATOMIC_ACQUIRE);
+            pending -= (int)(tail - consumed);
+            tail = consumed;
+            __atomic_store_n(engine->sqTail, tail, __ATOMIC_RELEASE);
+            toSubmit = 0;
+            result = -1;
+        } else if (ret > 0) {
+            toSubmit -= ret < toSubmit ? ret : toSubmit;
+        }
+
+        unsigned head = *engine->cqHead;
+        unsigned cqTail = __atomic_load_n(engine->cqTail, __ATOMIC_ACQUIRE);
+        while (head != cqTail) {
+            struct io_uring_cqe* cqe = &engine->cqes[head & *engine->cqMask];
+            IoRequest* req = &engine->requests[cqe->user_data];
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                result = -1;
+            } else if (finishRequest(req, (size_t)cqe->res) != 0) {
+                result = -1;
+            }
+            head++;
+            pending--;
+        }
+        __atomic_store_n(engine->cqHead, head, __ATOMIC_RELEASE);
+    }
+    if (error != 0) {
+        errno = error;
+    }
+    return result;
 }
+#endif
 
 
-void writeInodeToDisk(FILE *fp, const Inode *inode, size_t maxFileNameLength) {
-    fwrite(inode, sizeof(Inode) - sizeof(char*), 1, fp); 
-    fwrite(inode->fileName, sizeof(char), maxFileNameLength, fp); 
+static void* ioWorker(void* arg) {
+    IoEngine* engine = (IoEngine*)arg;
+    pthread_mutex_lock(&engine->lock);
+    while (true) {
+        while (!engine->stopping && engine->next >= engine->batch) {
+            pthread_cond_wait(&engine->work, &engine->lock);
+        }
+        if (engine->stopping) break;
+        IoRequest* req = &engine->requests[engine->next++];
+        pthread_mutex_unlock(&engine->lock);
+        int result = finishRequest(req, 0);
+        int error = errno;
+        pthread_mutex_lock(&engine->lock);
+        if (result != 0 && engine->error == 0) {
+            engine->error = error;
+        }
+        if (++engine->finished == engine->batch) {
+            pthread_cond_signal(&engine->done);
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
 }
 
 
-void readInodeArea(Inode* inodes, int count) {
-    fseek(g_diskFile, g_superBlock.inodeAreaOffset, SEEK_SET);
-    fread(inodes, sizeof(Inode), count, g_diskFile);
+static void ioPoolStop(IoEngine* engine) {
+    pthread_mutex_lock(&engine->lock);
+    engine->stopping = true;
+    pthread_cond_broadcast(&engine->work);
+    pthread_mutex_unlock(&engine->lock);
+    for (int i = 0; i < engine->workers; i++) {
+        pthread_join(engine->threads[i], NULL);
+    }
+    pthread_cond_destroy(&engine->done);
+    pthread_cond_destroy(&engine->work);
+    pthread_mutex_destroy(&engine->lock);
+    engine->workers = 0;
 }
 
 
-void writeBitmap(unsigned char* bitmap, int size) {
-    fseek(g_diskFile, g_superBlock.bitmapOffset, SEEK_SET);
-    fwrite(bitmap, 1, size, g_diskFile);
-    fflush(g_diskFile);
+//one worker per request kept in flight, up to MAX_IO_WORKERS
+static int ioPoolStart(IoEngine* engine) {
+    int wanted = engine->depth < MAX_IO_WORKERS ? engine->depth : MAX_IO_WORKERS;
+    if (wanted < 2) {
+        return -1;
+    }
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->work, NULL);
+    pthread_cond_init(&engine->done, NULL);
+    while (engine->workers < wanted
+           && pthread_create(&engine->threads[engine->workers], NULL, ioWorker, engine) == 0) {
+        engine->workers++;
+    }
+    if (engine->workers < 2) {
+        ioPoolStop(engine);
+        return -1;
+    }
+    return 0;
 }
 
 
-void readBitmap(unsigned char* bitmap, int size) {
-    fseek(g_diskFile, g_superBlock.bitmapOffset, SEEK_SET);
-    fread(bitmap, 1, size, g_diskFile);
+static int ioPoolRun(IoEngine* engine) {
+    pthread_mutex_lock(&engine->lock);
+    engine->batch = engine->queued;
+    engine->next = 0;
+    engine->finished = 0;
+    engine->error = 0;
+    pthread_cond_broadcast(&engine->work);
+    while (engine->finished < engine->batch) {
+        pthread_cond_wait(&engine->done, &engine->lock);
+    }
+    int error = engine->error;
+    engine->batch = 0;
+    engine->next = 0;
+    pthread_mutex_unlock(&engine->lock);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
 }
 
 
-int createVirtualDisk(const char* diskName, size_t diskSize, size_t blockSize) {
-    FILE *fp = fopen(diskName, "wb");
-    if (!fp) {
-        printf("Cannot create virtual disk file!\n");
-        return 1;
+//VFS_IO_ENGINE picks uring, threads or sync, VFS_QUEUE_DEPTH sets blocks kept in flight.
+//Without a choice the best available engine is used; a chosen engine that is not
+//available is reported on stderr along with the one used instead.
+static int ioEngineInit(IoEngine* engine) {
+    memset(engine, 0, sizeof(*engine));
+    engine->depth = DEFAULT_QUEUE_DEPTH;
+    const char* depthEnv = getenv("VFS_QUEUE_DEPTH");
+    if (depthEnv != NULL && atoi(depthEnv) > 0) {
+        engine->depth = atoi(depthEnv);
+    }
+    if (engine->depth > MAX_QUEUE_DEPTH) {
+        engine->depth = MAX_QUEUE_DEPTH;
     }
 
-    SuperBlock sb;
-    strcpy(sb.diskName, diskName);
-    sb.diskSize         = diskSize;
-    sb.blockSize        = blockSize;
-    sb.blocksCount      = diskSize / blockSize;
-    sb.inodeAreaSize    = MAX_FILES * sizeof(Inode);
-    sb.bitmapSize       = (sb.blocksCount + 7) / 8;
-    sb.inodeAreaOffset  = sizeof(SuperBlock);
-    sb.bitmapOffset     = sb.inodeAreaOffset + sb.inodeAreaSize;
-    sb.dataAreaOffset   = sb.bitmapOffset + sb.bitmapSize;
+    //a transfer step keeps one window of writes and the next window of reads in flight
+    engine->capacity = engine->depth * 2;
+    engine->requests = (IoRequest*)calloc(engine->capacity, sizeof(IoRequest));
+    if (engine->requests == NULL) {
+        return -1;
+    }
 
-    fwrite(&sb, sizeof(SuperBlock), 1, fp);
+    const char* wanted = getenv("VFS_IO_ENGINE");
+    if (wanted != NULL && strcmp(wanted, "uring") != 0 && strcmp(wanted, "threads") != 0
+        && strcmp(wanted, "sync") != 0) {
+        wanted = NULL;
+    }
+#ifdef VFS_HAVE_URING
+    engine->ringFd = -1;
+    if (wanted == NULL || strcmp(wanted, "uring") == 0) {
+        engine->useUring = ioUringSetup(engine, engine->capacity) == 0;
+    }
+    if (engine->useUring) {
+        engine->name = "uring";
+    }
+#endif
+    if (engine->name == NULL && (wanted == NULL || strcmp(wanted, "sync") != 0) && ioPoolStart(engine) == 0) {
+        engine->name = "threads";
+    }
+    if (engine->name == NULL) {
+        engine->name = "sync";
+    }
 
-    Inode* inodes = (Inode*)calloc(MAX_FILES, sizeof(Inode));
-    for (int i = 0; i < MAX_FILES; i++) {
-        inodes[i].isUsed = false;
+    static bool reported = false;
+    if (wanted != NULL && strcmp(wanted, engine->name) != 0 && !reported) {
+        fprintf(stderr, "I/O engine %s is not available, using %s\n", wanted, engine->name);
+        reported = true;
     }
+    return 0;
+}
 
-    fseek(fp, sb.inodeAreaOffset, SEEK_SET);
-    fwrite(inodes, sizeof(Inode), MAX_FILES, fp);
-    free(inodes);
 
-    unsigned char* bitmap = (unsigned char*)calloc(1, sb.bitmapSize);
-    memset(bitmap, 0, sb.bitmapSize);
+static void ioEngineClose(IoEngine* engine) {
+#ifdef VFS_HAVE_URING
+    if (engine->useUring) ioUringRelease(engine);
+#endif
+    if (engine->workers > 0) ioPoolStop(engine);
+    free(engine->requests);
+    engine->requests = NULL;
+}
 
-    fseek(fp, sb.bitmapOffset, SEEK_SET);
-    fwrite(bitmap, 1, sb.bitmapSize, fp);
-    free(bitmap);
-    fseek(fp, diskSize - 1, SEEK_SET);
-    fputc('\0', fp);
-    fclose(fp);
 
-    printf("Virtual disk created: %s (%lu bytes)\n", diskName, (unsigned long)diskSize);
+static int ioEngineWait(IoEngine* engine) {
+    int result = 0;
+#ifdef VFS_HAVE_URING
+    if (engine->useUring) {
+        result = ioUringRun(engine);
+        engine->queued = 0;
+        return result;
+    }
+#endif
+    if (engine->workers > 0) {
+        result = ioPoolRun(engine);
+        engine->queued = 0;
+        return result;
+    }
+    for (int i = 0; i < engine->queued; i++) {
+        if (finishRequest(&engine->requests[i], 0) != 0) {
+            result = -1;
+        }
+    }
+    engine->queued = 0;
+    return result;
+}
+
+
+static int ioEngineQueue(IoEngine* engine, bool isWrite, int fd, void* buffer, size_t length, off_t offset) {
+    if (engine->queued == engine->capacity && ioEngineWait(engine) != 0) {
+        return -1;
+    }
+    IoRequest* req = &engine->requests[engine->queued++];
+    req->isWrite      = isWrite;
+    req->fd           = fd;
+    req->iov.iov_base = buffer;
+    req->iov.iov_len  = length;
+    req->offset       = offset;
     return 0;
 }
 
 
-void printBitmap(const char* bitmap, int size) {
-    int zeroCount = 0;
-    for (int i = 0; i < size; i++) {
-        for (int j = 0; j < 8; j++) {
-            if ((bitmap[i] >> j) & 1) {
-                if (zeroCount > 40) {
-                    printf("...%d blocks left... ", zeroCount);
-                } else {
-                    for (int k = 0; k < zeroCount; k++) {
-                        printf("0");
-                    }
-                }
-                zeroCount = 0;
-                printf("1");
-            } else {
-                zeroCount++;
-            }
-        }
+//the buffer of move m in a window that starts at move start
+static unsigned char* moveBuffer(BlockMove* moves, int m, unsigned char* buffers, int start, size_t bufferSize) {
+    if (moves[m].held) {
+        return moves[m].held;
     }
-    if (zeroCount > 0) {
-        if (zeroCount > 40) {
-            printf("...%d blocks left... ", zeroCount);
-        } else {
-            for (int k = 0; k < zeroCount; k++) {
-                printf("0");
-            }
+    return buffers + (size_t)(m - start) * bufferSize;
+}
+
+
+static int queueMoveReads(IoEngine* engine, BlockMove* moves, int from, int to,
+                          unsigned char* buffers, size_t bufferSize) {
+    for (int m = from; m < to; m++) {
+        if (moves[m].held) continue;
+        if (ioEngineQueue(engine, false, moves[m].srcFd, moveBuffer(moves, m, buffers, from, bufferSize),
+                          moves[m].length, moves[m].srcOffset) != 0) {
+            return -1;
         }
     }
-    printf("\n");
+    return 0;
 }
 
 
-int addNewFile(const char* diskName, const char* filename, size_t fileSize) {
-    if (strlen(filename) >= MAX_FILENAME_LENGTH) {
-        printf("Filename too long\n");
-        return -1;
+static int moveWindowEnd(const BlockMove* moves, int start, int count, int window) {
+    int end = start + 1;
+    while (end < count && end - start < window && !moves[end].barrier) {
+        end++;
     }
+    return end;
+}
 
-    FILE *fp = fopen(diskName, "rb+");
-    if (fp == NULL) {
-        perror("Failed to open virtual disk");
+
+//Moves must be ordered so that no move reads a block an earlier move writes, unless
+//its data is already held. Writes of one window overlap the reads of the next one;
+//windowDone, if given, runs once a window's writes are complete and before the next
+//window's writes are queued.
+static int runBlockMoves(IoEngine* engine, BlockMove* moves, int count, size_t bufferSize,
+                         void (*windowDone)(int start, int end, void* context), void* context) {
+    if (count == 0) {
+        return 0;
+    }
+    int window = engine->depth < count ? engine->depth : count;
+    unsigned char* buffers = (unsigned char*)malloc(2 * (size_t)window * bufferSize);
+    if (buffers == NULL) {
+        perror("Failed to allocate transfer buffers");
         return -1;
     }
 
-    g_diskFile = fp;
-    readSuperBlock();
-    SuperBlock sb = g_superBlock;
+    int start = 0;
+    int end = moveWindowEnd(moves, 0, count, window);
+    int half = 0;
+    int result = queueMoveReads(engine, moves, start, end, buffers, bufferSize);
+    result |= ioEngineWait(engine);
+
+    while (start < count && result == 0) {
+        unsigned char* current = buffers + (size_t)half * window * bufferSize;
+        unsigned char* following = buffers + (size_t)(1 - half) * window * bufferSize;
+        int next = end < count ? moveWindowEnd(moves, end, count, window) : count;
+        for (int m = start; m < end && result == 0; m++) {
+            result = ioEngineQueue(engine, true, moves[m].dstFd, moveBuffer(moves, m, current, start, bufferSize),
+                                   moves[m].length, moves[m].dstOffset);
+        }
+        if (result == 0) {
+            result = queueMoveReads(engine, moves, end, next, following, bufferSize);
+        }
+        result |= ioEngineWait(engine);
+        if (result == 0 && windowDone != NULL) {
+            windowDone(start, end, context);
+        }
+        start = end;
+        end = next;
+        half = 1 - half;
+    }
 
-    unsigned char* bitmap = (unsigned char*)calloc(1, sb.bitmapSize);
-    if (bitmap == NULL) {
-        perror("Failed to allocate memory for bitmap");
-        fclose(fp);
-        return -1;
+    if (result != 0) {
+        perror("Block transfer failed");
     }
-    readBitmap(bitmap, sb.bitmapSize);
+    free(buffers);
+    return result;
+}
 
-    Inode inodes[MAX_FILES];
-    readInodeArea(inodes, MAX_FILES);
 
-    int inodeIndex = -1;
+void deleteInode(Inode* inode) {
+    inode->isUsed = false;
+    inode->fileSize = 0;
+    inode->blocksAllocated = 0;
+    inode->storage = STORAGE_BLOCKS;
+    inode->tailSlot = 0;
+    memset(inode->fileName, 0, MAX_FILENAME_LENGTH); 
+    memset(inode->blockIndex, 0, sizeof(inode->blockIndex)); 
+}
+
+
+static size_t tailLength(const Inode* inode) {
+    return inode->fileSize - (size_t)inode->blocksAllocated * g_superBlock.blockSize;
+}
+
+
+static int fragmentSlots(size_t tailBytes) {
+    return (sizeof(FragmentHeader) + tailBytes + FRAGMENT_ALIGN - 1) / FRAGMENT_ALIGN;
+}
+
+
+//a packed tail's fragment block follows the file's whole blocks in its block index
+static int fragmentBlockOf(const Inode* inode) {
+    return inode->blockIndex[inode->blocksAllocated];
+}
+
+
+static bool tailInBlock(const Inode* inode, int fragmentBlock) {
+    return inode->isUsed && inode->storage == STORAGE_TAIL && fragmentBlockOf(inode) == fragmentBlock;
+}
+
+
+//lowest inode other than skipIndex with a tail in fragmentBlock, or -1 if there is none
+static int firstTailInBlock(const Inode* inodes, int fragmentBlock, int skipIndex) {
+    for (int j = 0; j < MAX_FILES; j++) {
+        if (j != skipIndex && tailInBlock(&inodes[j], fragmentBlock)) return j;
+    }
+    return -1;
+}
+
+
+//VFS_PACK_SMALL_FILES=0 turns off inline data and tail packing for new allocations
+static bool smallFilePacking() {
+    const char* env = getenv("VFS_PACK_SMALL_FILES");
+    return env == NULL || strcmp(env, "0") != 0;
+}
+
+
+//First fit over the fragment blocks the other tails already use, else a fresh block.
+//Free space inside a fragment block is derived from the inode table alone.
+static int placeTail(const Inode* inodes, unsigned char* bitmap, size_t tailBytes, int* fragmentBlock, int* slot) {
+    int needed = fragmentSlots(tailBytes);
+    int slotsPerBlock = g_superBlock.blockSize / FRAGMENT_ALIGN;
     for (int i = 0; i < MAX_FILES; i++) {
-        if (inodes[i].isUsed && strcmp(inodes[i].fileName, filename) == 0) {
-            char response;
-            printf("File %s already exists. Overwrite? (y/n): ", filename);
-            scanf(" %c", &response);
-            if (response == 'y' || response == 'Y') {
-                inodeIndex = i;
-                break;
-            } else {
-                free(bitmap);
-                fclose(fp);
-                printf("Operation cancelled\n");
+        if (!inodes[i].isUsed || inodes[i].storage != STORAGE_TAIL) continue;
+        int block = fragmentBlockOf(&inodes[i]);
+        if (firstTailInBlock(inodes, block, -1) != i) continue;
+
+        //occupied ranges of this block, sorted by start
+        int starts[MAX_FILES];
+        int ends[MAX_FILES];
+        int count = 0;
+        for (int j = i; j < MAX_FILES; j++) {
+            if (!tailInBlock(&inodes[j], block)) continue;
+            int start = inodes[j].tailSlot;
+            int end = start + fragmentSlots(tailLength(&inodes[j]));
+            int k = count++;
+            while (k > 0 && starts[k - 1] > start) {
+                starts[k] = starts[k - 1];
+                ends[k] = ends[k - 1];
+                k--;
+            }
+            starts[k] = start;
+            ends[k] = end;
+        }
+        int gapStart = 0;
+        for (int k = 0; k <= count; k++) {
+            int gapEnd = k < count ? starts[k] : slotsPerBlock;
+            if (gapEnd - gapStart >= needed) {
+                *fragmentBlock = block;
+                *slot = gapStart;
                 return 0;
             }
+            if (k < count && ends[k] > gapStart) gapStart = ends[k];
         }
-        if (!inodes[i].isUsed && inodeIndex == -1) {
-            inodeIndex = i;
+    }
+
+    for (int i = 0; i < g_superBlock.blocksCount; i++) {
+        if (!isBlockUsed(bitmap, i)) {
+            setBlockUsed(bitmap, i, true);
+            *fragmentBlock = i;
+            *slot = 0;
+            return 0;
         }
     }
+    return -ENOSPC;
+}
 
-    if (inodeIndex == -1) {
-        printf("No free inode available\n");
-        free(bitmap);
-        fclose(fp);
-        return -1;
+
+//First-fit allocation of the storage for fileSize bytes; returns -EFBIG or -ENOSPC on failure.
+//Files that fit in the inode record go inline, and a tail of at most half a block
+//(header included) is packed into a fragment block instead of taking a block of its own.
+static int allocateFileBlocks(Inode* inodes, int inodeIndex, unsigned char* bitmap, size_t fileSize) {
+    Inode* inode = &inodes[inodeIndex];
+    size_t blockSize = g_superBlock.blockSize;
+    bool packing = smallFilePacking();
+    inode->storage = STORAGE_BLOCKS;
+    inode->tailSlot = 0;
+    inode->blocksAllocated = 0;
+    if (packing && fileSize > 0 && fileSize <= INLINE_DATA_SIZE) {
+        inode->storage = STORAGE_INLINE;
+        memset(inode->inlineData, 0, INLINE_DATA_SIZE);
+        return 0;
     }
 
-    size_t requiredBlocks = (fileSize + sb.blockSize - 1) / sb.blockSize;
-    if (requiredBlocks > INODE_BLOCK_NUM) {
-        printf("File size too large, exceeds maximum block limit per inode\n");
-        free(bitmap);
-        fclose(fp);
-        return -1;
+    size_t tail = fileSize % blockSize;
+    bool packTail = packing && tail > 0 && sizeof(FragmentHeader) + tail <= blockSize / 2
+        && blockSize / FRAGMENT_ALIGN <= 65536;
+    size_t requiredBlocks = packTail ? fileSize / blockSize : (fileSize + blockSize - 1) / blockSize;
+    if (requiredBlocks + (packTail ? 1 : 0) > INODE_BLOCK_NUM) {
+        return -EFBIG;
     }
 
     size_t allocatedBlocks = 0;
-    for (size_t i = 0; i < sb.blocksCount && allocatedBlocks < requiredBlocks; i++) {
+    for (int i = 0; i < g_superBlock.blocksCount && allocatedBlocks < requiredBlocks; i++) {
         if (!isBlockUsed(bitmap, i)) {
             setBlockUsed(bitmap, i, true);
-            inodes[inodeIndex].blockIndex[allocatedBlocks] = i;
+            inode->blockIndex[allocatedBlocks] = i;
             allocatedBlocks++;
         }
     }
 
     if (allocatedBlocks < requiredBlocks) {
-        printf("Not enough free space available to store the file\n");
         for (size_t i = 0; i < allocatedBlocks; i++) {
-            setBlockUsed(bitmap, inodes[inodeIndex].blockIndex[i], false);
+            setBlockUsed(bitmap, inode->blockIndex[i], false);
         }
-        free(bitmap);
-        fclose(fp);
-        return -1;
+        return -ENOSPC;
     }
 
-    strncpy(inodes[inodeIndex].fileName, filename, MAX_FILENAME_LENGTH);
-    inodes[inodeIndex].fileSize = fileSize;
-    inodes[inodeIndex].isUsed = true;
-    inodes[inodeIndex].blocksAllocated = allocatedBlocks;
+    if (packTail) {
+        int fragmentBlock;
+        int slot;
+        if (placeTail(inodes, bitmap, tail, &fragmentBlock, &slot) != 0) {
+            for (size_t i = 0; i < allocatedBlocks; i++) {
+                setBlockUsed(bitmap, inode->blockIndex[i], false);
+            }
+            return -ENOSPC;
+        }
+        inode->blockIndex[allocatedBlocks] = fragmentBlock;
+        inode->tailSlot = slot;
+        inode->storage = STORAGE_TAIL;
+    }
+    inode->blocksAllocated = allocatedBlocks;
+    return 0;
+}
 
-    writeInodeArea(inodes, MAX_FILES);
-    writeBitmap(bitmap, sb.bitmapSize);
 
+//the fragment block is freed along with its last tail
+static void releaseTail(const Inode* inodes, int inodeIndex, unsigned char* bitmap) {
+    int fragmentBlock = fragmentBlockOf(&inodes[inodeIndex]);
+    if (firstTailInBlock(inodes, fragmentBlock, inodeIndex) == -1) {
+        setBlockUsed(bitmap, fragmentBlock, false);
+    }
+}
+
+
+static void releaseFileBlocks(Inode* inodes, int inodeIndex, unsigned char* bitmap) {
+    Inode* inode = &inodes[inodeIndex];
+    for (int i = 0; i < inode->blocksAllocated; i++) {
+        setBlockUsed(bitmap, inode->blockIndex[i], false);
+    }
+    if (inode->storage == STORAGE_TAIL) {
+        releaseTail(inodes, inodeIndex, bitmap);
+    }
+    inode->blocksAllocated = 0;
+    inode->storage = STORAGE_BLOCKS;
+    inode->tailSlot = 0;
+}
+
+
+//serve holds an exclusive lock for as long as it runs; commands that change the disk
+//take an exclusive lock and the others a shared one, and fail rather than wait
+static int lockDisk(FILE* fp, bool exclusive) {
+    if (flock(fileno(fp), (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK) {
+            printf("Virtual disk is in use by another process\n");
+        } else {
+            perror("Failed to lock virtual disk");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+
+void writeSuperBlock() {
+    fseek(g_diskFile, 0, SEEK_SET);
+    fwrite(&g_superBlock, sizeof(SuperBlock), 1, g_diskFile);
+    fflush(g_diskFile);
+}
+
+
+void readSuperBlock() {
+    fseek(g_diskFile, 0, SEEK_SET);
+    fread(&g_superBlock, sizeof(SuperBlock), 1, g_diskFile);
+    if (g_superBlock.inodeAreaOffset < (int)sizeof(SuperBlock)) {
+        //images from before striping keep all data in the disk file itself
+        g_superBlock.memberCount = 1;
+        g_superBlock.stripeUnit = 1;
+        memset(g_superBlock.memberPaths, 0, sizeof(g_superBlock.memberPaths));
+    }
+}
+
+
+//member 0 is the disk file itself, which also holds all metadata
+static int openMembers(bool writable) {
+    g_memberFds[0] = fileno(g_diskFile);
+    for (int m = 1; m < g_superBlock.memberCount; m++) {
+        g_memberFds[m] = open(g_superBlock.memberPaths[m], writable ? O_RDWR : O_RDONLY);
+        if (g_memberFds[m] < 0) {
+            printf("Failed to open stripe member %s: %s\n", g_superBlock.memberPaths[m], strerror(errno));
+            while (--m > 0) close(g_memberFds[m]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static void closeMembers() {
+    for (int m = 1; m < g_superBlock.memberCount; m++) {
+        close(g_memberFds[m]);
+    }
+}
+
+
+//RAID-0 mapping: runs of stripeUnit blocks go to the members in turn
+static void locateBlock(int blockIndex, int* fd, off_t* offset) {
+    int unit = g_superBlock.stripeUnit;
+    int stripe = blockIndex / unit;
+    int member = stripe % g_superBlock.memberCount;
+    off_t memberBlock = (off_t)(stripe / g_superBlock.memberCount) * unit + blockIndex % unit;
+    *fd = g_memberFds[member];
+    *offset = (member == 0 ? g_superBlock.dataAreaOffset : 0) + memberBlock * (off_t)g_superBlock.blockSize;
+}
+
+
+//position of a packed tail's FragmentHeader; the tail bytes follow it
+static void locateTail(const Inode* inode, int* fd, off_t* offset) {
+    locateBlock(fragmentBlockOf(inode), fd, offset);
+    *offset += (off_t)inode->tailSlot * FRAGMENT_ALIGN;
+}
+
+
+//true if the header in front of a packed tail names its inode and length, members must be open
+static bool fragmentHeaderMatches(const Inode* inodes, int inodeIndex) {
+    FragmentHeader header;
+    IoRequest req;
+    req.isWrite      = false;
+    req.iov.iov_base = &header;
+    req.iov.iov_len  = sizeof(header);
+    locateTail(&inodes[inodeIndex], &req.fd, &req.offset);
+    return finishRequest(&req, 0) == 0 && header.owner == inodeIndex
+        && header.length == tailLength(&inodes[inodeIndex]);
+}
+
+
+//stamps the header of a freshly placed tail, members must be open
+static int writeFragmentHeader(const Inode* inodes, int inodeIndex) {
+    FragmentHeader header = { (uint16_t)inodeIndex, 0, (uint32_t)tailLength(&inodes[inodeIndex]) };
+    IoRequest req;
+    req.isWrite      = true;
+    req.iov.iov_base = &header;
+    req.iov.iov_len  = sizeof(header);
+    locateTail(&inodes[inodeIndex], &req.fd, &req.offset);
+    return finishRequest(&req, 0);
+}
+
+
+int writeInodeArea(Inode* inodes, int count) {
+    if (fseek(g_diskFile, g_superBlock.inodeAreaOffset, SEEK_SET) != 0) return -1;
+    size_t written = fwrite(inodes, sizeof(Inode), count, g_diskFile);
+    if (fflush(g_diskFile) != 0 || written != (size_t)count) return -1;
+    return 0;
+}
+
+
+void writeInodeToDisk(FILE *fp, const Inode *inode, size_t maxFileNameLength) {
+    fwrite(inode, sizeof(Inode) - sizeof(char*), 1, fp); 
+    fwrite(inode->fileName, sizeof(char), maxFileNameLength, fp); 
+}
+
+
+void readInodeArea(Inode* inodes, int count) {
+    fseek(g_diskFile, g_superBlock.inodeAreaOffset, SEEK_SET);
+    fread(inodes, sizeof(Inode), count, g_diskFile);
+}
+
+
+int writeBitmap(unsigned char* bitmap, int size) {
+    if (fseek(g_diskFile, g_superBlock.bitmapOffset, SEEK_SET) != 0) return -1;
+    size_t written = fwrite(bitmap, 1, size, g_diskFile);
+    if (fflush(g_diskFile) != 0 || written != (size_t)size) return -1;
+    return 0;
+}
+
+
+void readBitmap(unsigned char* bitmap, int size) {
+    fseek(g_diskFile, g_superBlock.bitmapOffset, SEEK_SET);
+    fread(bitmap, 1, size, g_diskFile);
+}
+
+
+//absolute form of a path whose file may not exist yet: its directory goes through realpath
+static int resolvePath(const char* path, char* resolved) {
+    char full[PATH_MAX];
+    if (realpath(path, full) == NULL) {
+        const char* slash = strrchr(path, '/');
+        char dir[PATH_MAX];
+        if (slash == NULL) {
+            strcpy(dir, ".");
+        } else if (slash == path) {
+            strcpy(dir, "/");
+        } else if (slash - path < PATH_MAX) {
+            memcpy(dir, path, slash - path);
+            dir[slash - path] = '\0';
+        } else {
+            return -1;
+        }
+        const char* base = slash == NULL ? path : slash + 1;
+        if (*base == '\0' || realpath(dir, full) == NULL
+            || strlen(full) + 1 + strlen(base) >= PATH_MAX) {
+            return -1;
+        }
+        if (strcmp(full, "/") != 0) strcat(full, "/");
+        strcat(full, base);
+    }
+    if (strlen(full) >= MEMBER_PATH_LENGTH) {
+        return -1;
+    }
+    strcpy(resolved, full);
+    return 0;
+}
+
+
+int createVirtualDisk(const char* diskName, size_t diskSize, size_t blockSize,
+                      int stripeUnit, int extraCount, char** extraPaths) {
+    //the disk file itself is member 0, the extra paths follow it
+    int memberCount = extraCount + 1;
+    if (memberCount > MAX_MEMBERS || stripeUnit <= 0) {
+        printf("Striping needs a positive stripe unit and at most %d members\n", MAX_MEMBERS);
+        return 1;
+    }
+    //members are opened later from wherever the tool runs, so keep absolute paths
+    char resolved[MAX_MEMBERS][MEMBER_PATH_LENGTH];
+    for (int m = 0; m < memberCount; m++) {
+        const char* path = m == 0 ? diskName : extraPaths[m - 1];
+        if (resolvePath(path, resolved[m]) != 0) {
+            printf("Cannot resolve member path %s, its directory must exist and the path be under %d bytes\n",
+                   path, MEMBER_PATH_LENGTH);
+            return 1;
+        }
+        for (int other = 0; other < m; other++) {
+            if (strcmp(resolved[m], resolved[other]) == 0) {
+                printf("Member path %s is the disk file or another member\n", path);
+                return 1;
+            }
+        }
+    }
+
+    //an image that is being served must not be truncated under the server
+    int diskFd = open(diskName, O_RDWR | O_CREAT, 0644);
+    FILE *fp = diskFd >= 0 ? fdopen(diskFd, "wb") : NULL;
+    if (!fp) {
+        if (diskFd >= 0) close(diskFd);
+        printf("Cannot create virtual disk file!\n");
+        return 1;
+    }
+    if (lockDisk(fp, true) != 0 || ftruncate(diskFd, 0) != 0) {
+        fclose(fp);
+        return 1;
+    }
+
+    SuperBlock sb;
+    memset(&sb, 0, sizeof(sb));
+    strcpy(sb.diskName, diskName);
+    sb.diskSize         = diskSize;
+    sb.blockSize        = blockSize;
+    sb.blocksCount      = diskSize / blockSize;
+    sb.inodeAreaSize    = MAX_FILES * sizeof(Inode);
+    sb.bitmapSize       = (sb.blocksCount + 7) / 8;
+    sb.inodeAreaOffset  = sizeof(SuperBlock);
+    sb.bitmapOffset     = sb.inodeAreaOffset + sb.inodeAreaSize;
+    sb.dataAreaOffset   = sb.bitmapOffset + sb.bitmapSize;
+    sb.memberCount      = memberCount;
+    sb.stripeUnit       = stripeUnit;
+    for (int m = 0; m < memberCount; m++) {
+        strcpy(sb.memberPaths[m], resolved[m]);
+    }
+
+    //every member gets room for the same number of whole stripe units
+    long long stripeBlocks = (long long)stripeUnit * memberCount;
+    long long memberBlocks = (sb.blocksCount + stripeBlocks - 1) / stripeBlocks * stripeUnit;
+    size_t memberSize = memberBlocks * blockSize;
+    for (int m = 1; m < memberCount; m++) {
+        FILE *member = fopen(resolved[m], "wb");
+        if (!member) {
+            printf("Cannot create stripe member %s\n", extraPaths[m - 1]);
+            while (--m > 0) remove(resolved[m]);
+            fclose(fp);
+            remove(diskName);
+            return 1;
+        }
+        fseek(member, memberSize - 1, SEEK_SET);
+        fputc('\0', member);
+        fclose(member);
+    }
+
+    fwrite(&sb, sizeof(SuperBlock), 1, fp);
+
+    Inode* inodes = (Inode*)calloc(MAX_FILES, sizeof(Inode));
+    for (int i = 0; i < MAX_FILES; i++) {
+        inodes[i].isUsed = false;
+    }
+
+    fseek(fp, sb.inodeAreaOffset, SEEK_SET);
+    fwrite(inodes, sizeof(Inode), MAX_FILES, fp);
+    free(inodes);
+
+    unsigned char* bitmap = (unsigned char*)calloc(1, sb.bitmapSize);
+    memset(bitmap, 0, sb.bitmapSize);
+
+    fseek(fp, sb.bitmapOffset, SEEK_SET);
+    fwrite(bitmap, 1, sb.bitmapSize, fp);
     free(bitmap);
+    fseek(fp, sb.dataAreaOffset + memberSize - 1, SEEK_SET);
+    fputc('\0', fp);
     fclose(fp);
 
-    printf("File %s of size %ld bytes added to virtual disk %s\n", filename, fileSize, diskName);
+    printf("Virtual disk created: %s (%lu bytes)\n", diskName, (unsigned long)diskSize);
+    if (memberCount > 1) {
+        printf("Striped across %d members with a stripe unit of %d blocks\n", memberCount, stripeUnit);
+    }
     return 0;
 }
 
 
-int removeFile(const char* diskName, const char* filename) {
-    FILE *fp = fopen(diskName, "rb+");
-    if (fp == NULL) {
-        perror("Failed to open virtual disk");
-        return -1;
+void printBitmap(const char* bitmap, int size) {
+    int zeroCount = 0;
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < 8; j++) {
+            if ((bitmap[i] >> j) & 1) {
+                if (zeroCount > 40) {
+                    printf("...%d blocks left... ", zeroCount);
+                } else {
+                    for (int k = 0; k < zeroCount; k++) {
+                        printf("0");
+                    }
+                }
+                zeroCount = 0;
+                printf("1");
+            } else {
+                zeroCount++;
+            }
+        }
+    }
+    if (zeroCount > 0) {
+        if (zeroCount > 40) {
+            printf("...%d blocks left... ", zeroCount);
+        } else {
+            for (int k = 0; k < zeroCount; k++) {
+                printf("0");
+            }
+        }
     }
+    printf("\n");
+}
 
+
+//adds an entry on a disk the caller has opened and locked
+static int addFileEntry(FILE* fp, const char* diskName, const char* filename, size_t fileSize) {
     g_diskFile = fp;
     readSuperBlock();
     SuperBlock sb = g_superBlock;
@@ -313,407 +1094,2088 @@ int removeFile(const char* diskName, const char* filename) {
     unsigned char* bitmap = (unsigned char*)calloc(1, sb.bitmapSize);
     if (bitmap == NULL) {
         perror("Failed to allocate memory for bitmap");
-        fclose(fp);
         return -1;
     }
     readBitmap(bitmap, sb.bitmapSize);
 
-    int fileFound = 0;
     Inode inodes[MAX_FILES];
     readInodeArea(inodes, MAX_FILES);
 
     int inodeIndex = -1;
     for (int i = 0; i < MAX_FILES; i++) {
         if (inodes[i].isUsed && strcmp(inodes[i].fileName, filename) == 0) {
-            fileFound = 1;
+            char response;
+            printf("File %s already exists. Overwrite? (y/n): ", filename);
+            scanf(" %c", &response);
+            if (response == 'y' || response == 'Y') {
+                inodeIndex = i;
+                break;
+            } else {
+                free(bitmap);
+                printf("Operation cancelled\n");
+                return 0;
+            }
+        }
+        if (!inodes[i].isUsed && inodeIndex == -1) {
             inodeIndex = i;
-            break;
         }
     }
 
-    if (!fileFound) {
-        printf("File %s not found on the virtual disk\n", filename);
+    if (inodeIndex == -1) {
+        printf("No free inode available\n");
         free(bitmap);
-        fclose(fp);
         return -1;
     }
 
-    for (int i = 0; i < inodes[inodeIndex].blocksAllocated; i++) {
-        setBlockUsed(bitmap, inodes[inodeIndex].blockIndex[i], false);
+    if (inodes[inodeIndex].isUsed) {
+        releaseFileBlocks(inodes, inodeIndex, bitmap);
+    }
+    int allocResult = allocateFileBlocks(inodes, inodeIndex, bitmap, fileSize);
+    if (allocResult == -EFBIG) {
+        printf("File size too large, exceeds maximum block limit per inode\n");
+        free(bitmap);
+        return -1;
+    }
+    if (allocResult != 0) {
+        printf("Not enough free space available to store the file\n");
+        free(bitmap);
+        return -1;
     }
 
-    deleteInode(&inodes[inodeIndex]);
+    strncpy(inodes[inodeIndex].fileName, filename, MAX_FILENAME_LENGTH);
+    inodes[inodeIndex].fileSize = fileSize;
+    inodes[inodeIndex].isUsed = true;
+
+    if (inodes[inodeIndex].storage == STORAGE_TAIL) {
+        int headerResult = openMembers(true);
+        if (headerResult == 0) {
+            headerResult = writeFragmentHeader(inodes, inodeIndex);
+            closeMembers();
+        }
+        if (headerResult != 0) {
+            printf("Failed to write fragment header\n");
+            free(bitmap);
+            return -1;
+        }
+    }
 
     writeInodeArea(inodes, MAX_FILES);
     writeBitmap(bitmap, sb.bitmapSize);
 
     free(bitmap);
-    fclose(fp);
 
-    printf("File %s has been deleted successfully\n", filename);
+    printf("File %s of size %ld bytes added to virtual disk %s\n", filename, fileSize, diskName);
     return 0;
 }
 
 
-int copyFileToVirtualDisk(const char* diskName, const char* filename) {
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        perror("Failed to open file");
-        return -1;
-    }
-
-    fseek(file, 0, SEEK_END);
-    size_t fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    char newFilename[MAX_FILENAME_LENGTH];
-    printf("Enter the name to store the file as: ");
-    scanf("%s", newFilename);
-
-    if (strlen(newFilename) >= MAX_FILENAME_LENGTH) {
-        printf("New filename is too long\n");
-        fclose(file);
+int addNewFile(const char* diskName, const char* filename, size_t fileSize) {
+    if (strlen(filename) >= MAX_FILENAME_LENGTH) {
+        printf("Filename too long\n");
         return -1;
     }
 
     FILE *fp = fopen(diskName, "rb+");
     if (fp == NULL) {
         perror("Failed to open virtual disk");
-        fclose(file);
         return -1;
     }
-
+    if (lockDisk(fp, true) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    int result = addFileEntry(fp, diskName, filename, fileSize);
+    fclose(fp);
+    return result;
+}
+
+
+int removeFile(const char* diskName, const char* filename) {
+    FILE *fp = fopen(diskName, "rb+");
+    if (fp == NULL) {
+        perror("Failed to open virtual disk");
+        return -1;
+    }
+    if (lockDisk(fp, true) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    g_diskFile = fp;
+    readSuperBlock();
+    SuperBlock sb = g_superBlock;
+
+    unsigned char* bitmap = (unsigned char*)calloc(1, sb.bitmapSize);
+    if (bitmap == NULL) {
+        perror("Failed to allocate memory for bitmap");
+        fclose(fp);
+        return -1;
+    }
+    readBitmap(bitmap, sb.bitmapSize);
+
+    int fileFound = 0;
+    Inode inodes[MAX_FILES];
+    readInodeArea(inodes, MAX_FILES);
+
+    int inodeIndex = -1;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (inodes[i].isUsed && strcmp(inodes[i].fileName, filename) == 0) {
+            fileFound = 1;
+            inodeIndex = i;
+            break;
+        }
+    }
+
+    if (!fileFound) {
+        printf("File %s not found on the virtual disk\n", filename);
+        free(bitmap);
+        fclose(fp);
+        return -1;
+    }
+
+    releaseFileBlocks(inodes, inodeIndex, bitmap);
+    deleteInode(&inodes[inodeIndex]);
+
+    writeInodeArea(inodes, MAX_FILES);
+    writeBitmap(bitmap, sb.bitmapSize);
+
+    free(bitmap);
+    fclose(fp);
+
+    printf("File %s has been deleted successfully\n", filename);
+    return 0;
+}
+
+
+//copies a file's data between the disk image and a host file, block i <-> host offset i * blockSize
+static int transferFileBlocks(Inode* inode, size_t fileSize, int hostFd, bool toDisk) {
+    if (inode->storage == STORAGE_INLINE) {
+        //inline data travels with the inode area, the caller writes that back
+        IoRequest req;
+        req.isWrite      = !toDisk;
+        req.fd           = hostFd;
+        req.iov.iov_base = inode->inlineData;
+        req.iov.iov_len  = fileSize < INLINE_DATA_SIZE ? fileSize : INLINE_DATA_SIZE;
+        req.offset       = 0;
+        return finishRequest(&req, 0);
+    }
+
+    BlockMove moves[INODE_BLOCK_NUM];
+    int count = 0;
+    for (int i = 0; i < inode->blocksAllocated; i++) {
+        size_t hostOffset = (size_t)i * g_superBlock.blockSize;
+        if (hostOffset >= fileSize) break;
+        size_t left = fileSize - hostOffset;
+        int diskFd;
+        off_t diskOffset;
+        locateBlock(inode->blockIndex[i], &diskFd, &diskOffset);
+        moves[count].srcFd     = toDisk ? hostFd : diskFd;
+        moves[count].srcOffset = toDisk ? (off_t)hostOffset : diskOffset;
+        moves[count].dstFd     = toDisk ? diskFd : hostFd;
+        moves[count].dstOffset = toDisk ? diskOffset : (off_t)hostOffset;
+        moves[count].length    = left < g_superBlock.blockSize ? left : g_superBlock.blockSize;
+        moves[count].held      = NULL;
+        moves[count].barrier   = false;
+        count++;
+    }
+
+    size_t hostOffset = (size_t)inode->blocksAllocated * g_superBlock.blockSize;
+    if (inode->storage == STORAGE_TAIL && fileSize > hostOffset) {
+        size_t tail = tailLength(inode);
+        if (fileSize - hostOffset < tail) tail = fileSize - hostOffset;
+        int diskFd;
+        off_t headerOffset;
+        locateTail(inode, &diskFd, &headerOffset);
+        off_t diskOffset = headerOffset + sizeof(FragmentHeader);
+        moves[count].srcFd     = toDisk ? hostFd : diskFd;
+        moves[count].srcOffset = toDisk ? (off_t)hostOffset : diskOffset;
+        moves[count].dstFd     = toDisk ? diskFd : hostFd;
+        moves[count].dstOffset = toDisk ? diskOffset : (off_t)hostOffset;
+        moves[count].length    = tail;
+        moves[count].held      = NULL;
+        moves[count].barrier   = false;
+        count++;
+    }
+
+    IoEngine engine;
+    if (ioEngineInit(&engine) != 0) {
+        perror("Failed to initialise I/O engine");
+        return -1;
+    }
+    int result = runBlockMoves(&engine, moves, count, g_superBlock.blockSize, NULL, NULL);
+    ioEngineClose(&engine);
+    return result;
+}
+
+
+int copyFileToVirtualDisk(const char* diskName, const char* filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror("Failed to open file");
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char newFilename[MAX_FILENAME_LENGTH];
+    printf("Enter the name to store the file as: ");
+    scanf("%s", newFilename);
+
+    if (strlen(newFilename) >= MAX_FILENAME_LENGTH) {
+        printf("New filename is too long\n");
+        fclose(file);
+        return -1;
+    }
+
+    FILE *fp = fopen(diskName, "rb+");
+    if (fp == NULL) {
+        perror("Failed to open virtual disk");
+        fclose(file);
+        return -1;
+    }
+    if (lockDisk(fp, true) != 0) {
+        fclose(fp);
+        fclose(file);
+        return -1;
+    }
+
+    g_diskFile = fp;
+    readSuperBlock();
+
+    Inode inodes[MAX_FILES];
+    readInodeArea(inodes, MAX_FILES);
+
+    int inodeIndex = -1;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (inodes[i].isUsed && strcmp(inodes[i].fileName, newFilename) == 0) {
+            char response;
+            printf("File %s already exists. Overwrite? (y/n): ", newFilename);
+            scanf(" %c", &response);
+            if (response == 'y' || response == 'Y') {
+                inodeIndex = i;
+                break;
+            } else {
+                fclose(file);
+                fclose(fp);
+                printf("Operation cancelled\n");
+                return 0;
+            }
+        }
+    }
+
+    if (inodeIndex == -1) {
+        int result = addFileEntry(fp, diskName, newFilename, fileSize);
+        if (result != 0) {
+            fclose(file);
+            fclose(fp);
+            return result;
+        }
+        readInodeArea(inodes, MAX_FILES);
+        for (int i = 0; i < MAX_FILES; i++) {
+            if (inodes[i].isUsed && strcmp(inodes[i].fileName, newFilename) == 0) {
+                inodeIndex = i;
+                break;
+            }
+        }
+    }
+
+    fflush(fp);
+    if (openMembers(true) != 0) {
+        fclose(file);
+        fclose(fp);
+        return -1;
+    }
+    int result = transferFileBlocks(&inodes[inodeIndex], fileSize, fileno(file), true);
+    closeMembers();
+    if (result != 0) {
+        printf("Error writing data to virtual disk\n");
+        fclose(file);
+        fclose(fp);
+        return -1;
+    }
+    if (inodes[inodeIndex].storage == STORAGE_INLINE) {
+        writeInodeArea(inodes, MAX_FILES);
+    }
+
+    fclose(file);
+    fclose(fp);
+    return 0;
+}
+
+
+int copyFileFromVirtualDisk(const char* diskName, const char* filename) {
+    FILE *fp = fopen(diskName, "rb");
+    if (fp == NULL) {
+        perror("Failed to open virtual disk");
+        return -1;
+    }
+    if (lockDisk(fp, false) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    g_diskFile = fp;
+    readSuperBlock();
+
+    Inode inodes[MAX_FILES];
+    readInodeArea(inodes, MAX_FILES);
+
+    int inodeIndex = -1;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (inodes[i].isUsed && strcmp(inodes[i].fileName, filename) == 0) {
+            inodeIndex = i;
+            break;
+        }
+    }
+
+    if (inodeIndex == -1) {
+        printf("File %s not found on the virtual disk\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    char newFilename[MAX_FILENAME_LENGTH];
+    printf("Enter the name to save the file as: ");
+    scanf("%s", newFilename);
+
+    if (strlen(newFilename) >= MAX_FILENAME_LENGTH) {
+        printf("New filename is too long\n");
+        fclose(fp);
+        return -1;
+    }
+
+    if (access(newFilename, F_OK) == 0) {
+        char response;
+        printf("File %s already exists. Overwrite? (y/n): ", newFilename);
+        scanf(" %c", &response);
+        if (response != 'y' && response != 'Y') {
+            fclose(fp);
+            printf("Operation cancelled\n");
+            return 0;
+        }
+    }
+
+    FILE *file = fopen(newFilename, "wb");
+    if (file == NULL) {
+        perror("Failed to open file");
+        fclose(fp);
+        return -1;
+    }
+
+    if (openMembers(false) != 0) {
+        fclose(file);
+        fclose(fp);
+        return -1;
+    }
+    int result = transferFileBlocks(&inodes[inodeIndex], inodes[inodeIndex].fileSize, fileno(file), false);
+    closeMembers();
+    if (result != 0) {
+        printf("Error copying data from virtual disk\n");
+        fclose(file);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(file);
+    fclose(fp);
+
+    printf("File %s copied from virtual disk %s and saved as %s\n", filename, diskName, newFilename);
+
+    return 0;
+}
+
+
+int listFiles(const char *diskName) {
+    FILE *fp = fopen(diskName, "rb");
+    if (!fp) {
+        perror("Failed to open virtual disk");
+        return -1;
+    }
+    if (lockDisk(fp, false) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
     g_diskFile = fp;
     readSuperBlock();
     SuperBlock sb = g_superBlock;
 
-    Inode inodes[MAX_FILES];
-    readInodeArea(inodes, MAX_FILES);
+    Inode inodes[MAX_FILES];
+    readInodeArea(inodes, MAX_FILES);
+
+    printf("Files on virtual disk %s:\n", diskName);
+    bool filesFound = false;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (inodes[i].isUsed) {
+            printf("File: %s, Size: %lu bytes\n", inodes[i].fileName, inodes[i].fileSize);
+            filesFound = true;
+        }
+    }
+    if (!filesFound) {
+        printf("No files on disk.\n");
+    }
+    fclose(fp);
+    return 0;
+}
+
+int showDiskUsage(const char* diskName) {
+    FILE *fp = fopen(diskName, "rb");
+    if (fp == NULL) {
+        perror("Failed to open virtual disk");
+        return -1;
+    }
+    if (lockDisk(fp, false) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    g_diskFile = fp;
+    readSuperBlock();
+    SuperBlock sb = g_superBlock;
+
+    printf("Disk Memory Usage:\n");
+
+    unsigned char* bitmap = (unsigned char*)calloc(1, sb.bitmapSize);
+    if (bitmap == NULL) {
+        perror("Failed to allocate memory for bitmap");
+        fclose(fp);
+        return -1;
+    }
+    readBitmap(bitmap, sb.bitmapSize);
+    printBitmap((const char*)bitmap, sb.bitmapSize);
+
+    free(bitmap);
+    fclose(fp);
+
+    return 0;
+}
+
+
+//free runs are bucketed by powers of two: bucket k holds runs of 2^k .. 2^(k+1)-1 blocks
+#define FREE_RUN_BUCKETS  32
+
+
+typedef struct {
+    long long usedBlocks;
+    long long freeBlocks;
+    long long freeRuns;
+    long long largestFreeRun;
+    long long largestFreeRunStart;
+    long long bucketRuns[FREE_RUN_BUCKETS];
+    long long bucketBlocks[FREE_RUN_BUCKETS];
+} FreeSpaceStats;
+
+
+static void recordFreeRun(FreeSpaceStats* stats, long long start, long long length) {
+    int bucket = 63 - __builtin_clzll((unsigned long long)length);
+    if (bucket >= FREE_RUN_BUCKETS) bucket = FREE_RUN_BUCKETS - 1;
+    stats->freeRuns++;
+    stats->bucketRuns[bucket]++;
+    stats->bucketBlocks[bucket] += length;
+    if (length > stats->largestFreeRun) {
+        stats->largestFreeRun = length;
+        stats->largestFreeRunStart = start;
+    }
+}
+
+
+//Walks the bitmap 64 blocks at a time. Words that are all used or all free inside a
+//run cost one compare; run edges are found with ctz instead of testing single bits.
+static void scanFreeSpace(const unsigned char* bitmap, int blocksCount, FreeSpaceStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    long long words = ((long long)blocksCount + 63) / 64;
+    bool inRun = false;
+    long long runStart = 0;
+
+    for (long long w = 0; w < words; w++) {
+        uint64_t used = 0;
+        long long byteIndex = w * 8;
+        long long bytes = ((long long)blocksCount + 7) / 8 - byteIndex;
+        memcpy(&used, bitmap + byteIndex, bytes < 8 ? bytes : 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        used = __builtin_bswap64(used);
+#endif
+        int validBits = blocksCount - w * 64 < 64 ? (int)(blocksCount - w * 64) : 64;
+        if (validBits < 64) {
+            //blocks past the end count as used so a trailing run ends there
+            used |= ~0ULL << validBits;
+        }
+        uint64_t freeBits = ~used;
+        stats->usedBlocks += __builtin_popcountll(used) - (64 - validBits);
+
+        if (inRun ? freeBits == ~0ULL : freeBits == 0) {
+            continue;
+        }
+        int offset = 0;
+        while (offset < 64) {
+            uint64_t rest = (inRun ? used : freeBits) >> offset;
+            if (rest == 0) break;
+            offset += __builtin_ctzll(rest);
+            long long position = w * 64 + offset;
+            if (inRun) {
+                recordFreeRun(stats, runStart, position - runStart);
+            } else {
+                runStart = position;
+            }
+            inRun = !inRun;
+        }
+    }
+    if (inRun) {
+        recordFreeRun(stats, runStart, blocksCount - runStart);
+    }
+    stats->freeBlocks = blocksCount - stats->usedBlocks;
+}
+
+
+static int countExtents(const Inode* inode) {
+    int extents = inode->blocksAllocated > 0 ? 1 : 0;
+    for (int b = 1; b < inode->blocksAllocated; b++) {
+        if (inode->blockIndex[b] != inode->blockIndex[b - 1] + 1) extents++;
+    }
+    return extents;
+}
+
+
+//0 when every file is contiguous, 1 when no two consecutive blocks of a file are adjacent
+static double fileFragmentation(int blocks, int extents) {
+    return blocks > 1 ? (double)(extents - 1) / (blocks - 1) : 0.0;
+}
+
+
+static const char* storageName(unsigned char storage) {
+    if (storage == STORAGE_INLINE) return "inline";
+    if (storage == STORAGE_TAIL) return "tail";
+    return "blocks";
+}
+
+
+static void printJsonString(const char* text) {
+    putchar('"');
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\') printf("\\%c", *c);
+        else if (*c < 0x20) printf("\\u%04x", *c);
+        else putchar(*c);
+    }
+    putchar('"');
+}
+
+
+int analyzeDisk(const char* diskName, bool json) {
+    FILE *fp = fopen(diskName, "rb");
+    if (fp == NULL) {
+        perror("Failed to open virtual disk");
+        return -1;
+    }
+    if (lockDisk(fp, false) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    g_diskFile = fp;
+    readSuperBlock();
+    SuperBlock sb = g_superBlock;
+
+    unsigned char* bitmap = (unsigned char*)calloc(1, sb.bitmapSize);
+    if (bitmap == NULL) {
+        perror("Failed to allocate memory for bitmap");
+        fclose(fp);
+        return -1;
+    }
+    readBitmap(bitmap, sb.bitmapSize);
+    Inode inodes[MAX_FILES];
+    readInodeArea(inodes, MAX_FILES);
+
+    int badHeaders = 0;
+    if (openMembers(false) != 0) {
+        free(bitmap);
+        fclose(fp);
+        return -1;
+    }
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (inodes[i].isUsed && inodes[i].storage == STORAGE_TAIL && !fragmentHeaderMatches(inodes, i)) {
+            badHeaders++;
+        }
+    }
+    closeMembers();
+    fclose(fp);
+
+    FreeSpaceStats stats;
+    scanFreeSpace(bitmap, sb.blocksCount, &stats);
+    free(bitmap);
+
+    int fileCount = 0;
+    long long fileBlocks = 0;
+    long long fileExtents = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!inodes[i].isUsed || inodes[i].blocksAllocated == 0) continue;
+        fileCount++;
+        fileBlocks += inodes[i].blocksAllocated;
+        fileExtents += countExtents(&inodes[i]);
+    }
+
+    //blocks that inline data and tail packing save over giving every file whole blocks
+    int inlineFiles = 0;
+    int packedTails = 0;
+    int fragmentBlocks = 0;
+    long long blocksSaved = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!inodes[i].isUsed) continue;
+        blocksSaved += (inodes[i].fileSize + sb.blockSize - 1) / sb.blockSize - inodes[i].blocksAllocated;
+        if (inodes[i].storage == STORAGE_INLINE) inlineFiles++;
+        if (inodes[i].storage != STORAGE_TAIL) continue;
+        packedTails++;
+        if (firstTailInBlock(inodes, fragmentBlockOf(&inodes[i]), -1) == i) fragmentBlocks++;
+    }
+    blocksSaved -= fragmentBlocks;
+
+    double freeFragmentation = stats.freeBlocks > 0 ? 1.0 - (double)stats.largestFreeRun / stats.freeBlocks : 0.0;
+    double diskFileFragmentation = fileBlocks > fileCount
+        ? (double)(fileExtents - fileCount) / (fileBlocks - fileCount) : 0.0;
+
+    if (json) {
+        printf("{\"disk\":");
+        printJsonString(diskName);
+        printf(",\"blockSize\":%lu,\"blocks\":%d,\"usedBlocks\":%lld,\"freeBlocks\":%lld,",
+               (unsigned long)sb.blockSize, sb.blocksCount, stats.usedBlocks, stats.freeBlocks);
+        printf("\"freeRuns\":%lld,\"largestFreeRun\":{\"start\":%lld,\"length\":%lld},",
+               stats.freeRuns, stats.largestFreeRunStart, stats.largestFreeRun);
+        printf("\"freeSpaceFragmentation\":%.4f,\"fileFragmentation\":%.4f,",
+               freeFragmentation, diskFileFragmentation);
+        printf("\"inlineFiles\":%d,\"packedTails\":%d,\"fragmentBlocks\":%d,\"blocksSaved\":%lld,",
+               inlineFiles, packedTails, fragmentBlocks, blocksSaved);
+        printf("\"badFragmentHeaders\":%d,\"freeRunHistogram\":[", badHeaders);
+        bool first = true;
+        for (int k = 0; k < FREE_RUN_BUCKETS; k++) {
+            if (stats.bucketRuns[k] == 0) continue;
+            printf("%s{\"minLength\":%lld,\"maxLength\":%lld,\"runs\":%lld,\"blocks\":%lld}", first ? "" : ",",
+                   1LL << k, (1LL << (k + 1)) - 1, stats.bucketRuns[k], stats.bucketBlocks[k]);
+            first = false;
+        }
+        printf("],\"files\":[");
+        first = true;
+        for (int i = 0; i < MAX_FILES; i++) {
+            if (!inodes[i].isUsed) continue;
+            int extents = countExtents(&inodes[i]);
+            printf("%s{\"name\":", first ? "" : ",");
+            printJsonString(inodes[i].fileName);
+            printf(",\"size\":%lu,\"storage\":\"%s\",\"blocks\":%d,\"extents\":%d,\"fragmentation\":%.4f}",
+                   (unsigned long)inodes[i].fileSize, storageName(inodes[i].storage), inodes[i].blocksAllocated,
+                   extents, fileFragmentation(inodes[i].blocksAllocated, extents));
+            first = false;
+        }
+        printf("]}\n");
+        return 0;
+    }
+
+    printf("Disk analysis of %s (%d blocks of %lu bytes):\n", diskName, sb.blocksCount, (unsigned long)sb.blockSize);
+    printf("Used: %lld blocks, Free: %lld blocks in %lld runs\n", stats.usedBlocks, stats.freeBlocks, stats.freeRuns);
+    printf("Largest free run: %lld blocks starting at block %lld\n", stats.largestFreeRun, stats.largestFreeRunStart);
+    printf("Free space fragmentation: %.4f, File fragmentation: %.4f\n", freeFragmentation, diskFileFragmentation);
+    printf("Inline files: %d, Packed tails: %d in %d fragment blocks, Blocks saved: %lld (%lld bytes)\n",
+           inlineFiles, packedTails, fragmentBlocks, blocksSaved, blocksSaved * (long long)sb.blockSize);
+    if (badHeaders > 0) {
+        printf("Fragment headers that disagree with the inode table: %d\n", badHeaders);
+    }
+    printf("Free run lengths:\n");
+    for (int k = 0; k < FREE_RUN_BUCKETS; k++) {
+        if (stats.bucketRuns[k] == 0) continue;
+        printf("  %10lld - %-10lld runs: %-10lld blocks: %lld\n",
+               1LL << k, (1LL << (k + 1)) - 1, stats.bucketRuns[k], stats.bucketBlocks[k]);
+    }
+    printf("Files:\n");
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!inodes[i].isUsed) continue;
+        int extents = countExtents(&inodes[i]);
+        printf("  File: %s, Storage: %s, Blocks: %d, Extents: %d, Fragmentation: %.4f\n", inodes[i].fileName,
+               storageName(inodes[i].storage), inodes[i].blocksAllocated, extents,
+               fileFragmentation(inodes[i].blocksAllocated, extents));
+    }
+    return 0;
+}
+
+
+int removeVirtualDisk(const char* diskName) {
+    FILE *fp = fopen(diskName, "rb");
+    if (fp != NULL) {
+        if (lockDisk(fp, true) != 0) {
+            fclose(fp);
+            return -1;
+        }
+        g_diskFile = fp;
+        readSuperBlock();
+        fclose(fp);
+        for (int m = 1; m < g_superBlock.memberCount && m < MAX_MEMBERS; m++) {
+            if (remove(g_superBlock.memberPaths[m]) != 0) {
+                perror("Failed to delete stripe member");
+            }
+        }
+    }
+    if (remove(diskName) == 0) {
+        printf("Virtual disk %s deleted successfully\n", diskName);
+        return 0;
+    } else {
+        perror("Failed to delete virtual disk");
+        return -1;
+    }
+}
+
+
+typedef struct {
+    int block;
+    int move;
+} MoveSource;
+
+
+static int compareMoveSources(const void* a, const void* b) {
+    return ((const MoveSource*)a)->block - ((const MoveSource*)b)->block;
+}
+
+
+//sources must be sorted by block
+static int findMoveBySource(const MoveSource* sources, int count, int block) {
+    MoveSource key = { block, -1 };
+    const MoveSource* found = (const MoveSource*)bsearch(&key, sources, count, sizeof(MoveSource), compareMoveSources);
+    return found != NULL ? found->move : -1;
+}
+
+
+//Orders moves so a block is read before the move targeting it writes over it.
+//Each block is the source and the target of at most one move, so the moves form
+//chains and cycles; a chain runs from its free end backwards, and the first move
+//of each cycle gets its source read up front (marked in needsHold). cycleAt maps
+//the position a cycle starts at in order to the move that closes it, or -1.
+static void orderBlockMoves(const int* moveDst, const MoveSource* sources,
+                            int count, int* order, bool* needsHold, int* cycleAt) {
+    int state[MAX_BLOCK_MOVES] = {0};
+    int path[MAX_BLOCK_MOVES];
+    int ordered = 0;
+    for (int s = 0; s < count; s++) {
+        cycleAt[s] = -1;
+    }
+    for (int s = 0; s < count; s++) {
+        if (state[s] != 0) continue;
+        int length = 0;
+        int m = s;
+        while (m != -1 && state[m] == 0) {
+            state[m] = 1;
+            path[length++] = m;
+            m = findMoveBySource(sources, count, moveDst[m]);
+        }
+        needsHold[s] = (m == s);
+        if (needsHold[s]) {
+            cycleAt[ordered] = s;
+        }
+        for (int j = length - 1; j >= 0; j--) {
+            state[path[j]] = 2;
+            order[ordered++] = path[j];
+        }
+    }
+}
+
+
+//an inode slot that points at the target of a move once its copy is written
+typedef struct {
+    int move;
+    int inode;
+    int slot;
+    int block;
+} BlockRef;
+
+
+typedef struct {
+    Inode*          inodes;    //the inode area as it is on disk
+    const BlockRef* refs;
+    int             refCount;
+} DefragProgress;
+
+
+static void commitMoveWindow(int start, int end, void* context) {
+    DefragProgress* progress = (DefragProgress*)context;
+    for (int r = 0; r < progress->refCount; r++) {
+        const BlockRef* ref = &progress->refs[r];
+        if (ref->move >= start && ref->move < end) {
+            progress->inodes[ref->inode].blockIndex[ref->slot] = ref->block;
+        }
+    }
+    writeInodeArea(progress->inodes, MAX_FILES);
+}
+
+
+static void addBlockMove(BlockMove* moves, int* moveSrc, int* moveDst, int* moveCount, int src, int dst) {
+    BlockMove* move = &moves[*moveCount];
+    locateBlock(src, &move->srcFd, &move->srcOffset);
+    locateBlock(dst, &move->dstFd, &move->dstOffset);
+    move->length  = g_superBlock.blockSize;
+    move->held    = NULL;
+    move->barrier = false;
+    moveSrc[*moveCount] = src;
+    moveDst[*moveCount] = dst;
+    (*moveCount)++;
+}
+
+
+//Every write lands on a block no inode on disk points at: the inode area is rewritten
+//after each window, and a window never writes over the source of one of its own moves.
+//A cycle is broken by parking its held block in a free block past the packed area, so
+//an I/O error leaves the image consistent with the completed part of the run; only a
+//cycle on a disk without any such free block still relies on the held copy in memory.
+int defragmentDisk(const char* diskName) {
+    g_diskFile = fopen(diskName, "rb+");
+    if (!g_diskFile) {
+        printf("Failed to open virtual disk: %s\n", diskName);
+        return 1;
+    }
+    if (lockDisk(g_diskFile, true) != 0) {
+        fclose(g_diskFile);
+        return 1;
+    }
+
+    readSuperBlock();
+
+    Inode inodes[MAX_FILES];
+    readInodeArea(inodes, MAX_FILES);
+    Inode onDisk[MAX_FILES];
+    memcpy(onDisk, inodes, sizeof(inodes));
+
+    unsigned char* bitmap = (unsigned char*)calloc(1, g_superBlock.bitmapSize);
+    if (bitmap == NULL || openMembers(true) != 0) {
+        if (bitmap == NULL) perror("Failed to allocate memory for defragmentation");
+        free(bitmap);
+        fclose(g_diskFile);
+        return 1;
+    }
+    readBitmap(bitmap, g_superBlock.bitmapSize);
+
+    //files are packed in inode order from block 0
+    size_t block_size = g_superBlock.blockSize;
+    static BlockMove moves[MAX_BLOCK_MOVES];
+    static BlockRef refs[2 * MAX_BLOCK_MOVES];
+    int moveSrc[MAX_BLOCK_MOVES];
+    int moveDst[MAX_BLOCK_MOVES];
+    int moveCount = 0;
+    int refCount = 0;
+    int nextFreeBlock = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!inodes[i].isUsed) continue;
+        for (int b = 0; b < inodes[i].blocksAllocated; b++) {
+            int currentBlockIndex = inodes[i].blockIndex[b];
+            if (currentBlockIndex != nextFreeBlock) {
+                refs[refCount++] = (BlockRef){ moveCount, i, b, nextFreeBlock };
+                addBlockMove(moves, moveSrc, moveDst, &moveCount, currentBlockIndex, nextFreeBlock);
+                inodes[i].blockIndex[b] = nextFreeBlock;
+            }
+            nextFreeBlock++;
+        }
+    }
+
+    //fragment blocks are shared, so each one moves once, after all whole blocks
+    bool tailPlaced[MAX_FILES] = {false};
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!inodes[i].isUsed || inodes[i].storage != STORAGE_TAIL || tailPlaced[i]) continue;
+        int fragmentBlock = fragmentBlockOf(&inodes[i]);
+        bool moved = fragmentBlock != nextFreeBlock;
+        if (moved) {
+            addBlockMove(moves, moveSrc, moveDst, &moveCount, fragmentBlock, nextFreeBlock);
+        }
+        for (int j = i; j < MAX_FILES; j++) {
+            if (!tailPlaced[j] && tailInBlock(&inodes[j], fragmentBlock)) {
+                if (moved) {
+                    refs[refCount++] = (BlockRef){ moveCount - 1, j, inodes[j].blocksAllocated, nextFreeBlock };
+                }
+                inodes[j].blockIndex[inodes[j].blocksAllocated] = nextFreeBlock;
+                tailPlaced[j] = true;
+            }
+        }
+        nextFreeBlock++;
+    }
+
+    MoveSource sources[MAX_BLOCK_MOVES];
+    for (int m = 0; m < moveCount; m++) {
+        sources[m] = (MoveSource){ moveSrc[m], m };
+    }
+    qsort(sources, moveCount, sizeof(MoveSource), compareMoveSources);
+    int order[MAX_BLOCK_MOVES];
+    int cycleAt[MAX_BLOCK_MOVES];
+    bool needsHold[MAX_BLOCK_MOVES] = {false};
+    orderBlockMoves(moveDst, sources, moveCount, order, needsHold, cycleAt);
+
+    //lay the moves out in run order, a parked cycle adds a move in front of the cycle
+    static BlockMove ordered[2 * MAX_BLOCK_MOVES];
+    int orderedSrc[2 * MAX_BLOCK_MOVES];
+    int orderedDst[2 * MAX_BLOCK_MOVES];
+    int position[MAX_BLOCK_MOVES];
+    int orderedCount = 0;
+    int parkingBlock = nextFreeBlock;
+    int result = 0;
+    for (int p = 0; p < moveCount && result == 0; p++) {
+        int s = cycleAt[p];
+        if (s != -1) {
+            moves[s].held = (unsigned char*)malloc(block_size);
+            if (moves[s].held == NULL) {
+                result = -1;
+                break;
+            }
+            while (parkingBlock < g_superBlock.blocksCount && isBlockUsed(bitmap, parkingBlock)) {
+                parkingBlock++;
+            }
+            if (parkingBlock < g_superBlock.blocksCount) {
+                BlockMove* park = &ordered[orderedCount];
+                *park = moves[s];
+                locateBlock(parkingBlock, &park->dstFd, &park->dstOffset);
+                //the parking refs carry their position already, stored as -(position + 1)
+                int parkedRefs = refCount;
+                for (int r = 0; r < parkedRefs; r++) {
+                    if (refs[r].move == s) {
+                        refs[refCount++] = (BlockRef){ -(orderedCount + 1), refs[r].inode, refs[r].slot, parkingBlock };
+                    }
+                }
+                orderedSrc[orderedCount] = moveSrc[s];
+                orderedDst[orderedCount] = parkingBlock;
+                orderedCount++;
+                moveSrc[s] = parkingBlock;
+                setBlockUsed(bitmap, parkingBlock, true);
+            }
+        }
+        int m = order[p];
+        position[m] = orderedCount;
+        ordered[orderedCount] = moves[m];
+        orderedSrc[orderedCount] = moveSrc[m];
+        orderedDst[orderedCount] = moveDst[m];
+        orderedCount++;
+    }
+    for (int r = 0; r < refCount; r++) {
+        refs[r].move = refs[r].move < 0 ? -refs[r].move - 1 : position[refs[r].move];
+    }
+
+    //a move may not share a window with the move that still needs its target's old contents
+    MoveSource orderedSources[2 * MAX_BLOCK_MOVES];
+    for (int m = 0; m < orderedCount; m++) {
+        orderedSources[m] = (MoveSource){ orderedSrc[m], m };
+    }
+    qsort(orderedSources, orderedCount, sizeof(MoveSource), compareMoveSources);
+    int windowStart = 0;
+    for (int m = 1; m < orderedCount; m++) {
+        int reader = findMoveBySource(orderedSources, orderedCount, orderedDst[m]);
+        if (reader >= windowStart && reader < m) {
+            ordered[m].barrier = true;
+            windowStart = m;
+        }
+    }
+
+    //targets and parking blocks stay allocated until the run is over
+    for (int m = 0; m < orderedCount; m++) {
+        setBlockUsed(bitmap, orderedDst[m], true);
+    }
+    writeBitmap(bitmap, g_superBlock.bitmapSize);
+
+    IoEngine engine = {0};
+    if (result == 0) {
+        result = ioEngineInit(&engine);
+    }
+    for (int m = 0; m < moveCount && result == 0; m++) {
+        if (moves[m].held) {
+            result = ioEngineQueue(&engine, false, moves[m].srcFd, moves[m].held, block_size, moves[m].srcOffset);
+        }
+    }
+    if (result == 0) {
+        result = ioEngineWait(&engine);
+    }
+    DefragProgress progress = { onDisk, refs, refCount };
+    if (result == 0) {
+        result = runBlockMoves(&engine, ordered, orderedCount, block_size, commitMoveWindow, &progress);
+    }
+    if (engine.requests != NULL) {
+        ioEngineClose(&engine);
+    }
+    for (int m = 0; m < moveCount; m++) {
+        free(moves[m].held);
+    }
+    closeMembers();
+
+    if (result != 0) {
+        printf("Defragmentation stopped early, the completed moves are recorded; run defrag again\n");
+        free(bitmap);
+        fclose(g_diskFile);
+        return 1;
+    }
+
+    memset(bitmap, 0, g_superBlock.bitmapSize);
+    for (int i = 0; i < nextFreeBlock; i++) {
+        setBlockUsed(bitmap, i, true);
+    }
+    writeInodeArea(inodes, MAX_FILES);
+    writeBitmap(bitmap, g_superBlock.bitmapSize);
+
+    free(bitmap);
+    fclose(g_diskFile);
+
+    printf("Defragmentation completed.\n");
+    return 0;
+}
+
+
+//serve mode: one process owns the image and answers pipelined requests from many clients
+//over a Unix domain socket. Integers go over the wire in native byte order since both
+//ends always run on the same host.
+enum {
+    OP_LS    = 1,
+    OP_ADD   = 2,
+    OP_RM    = 3,
+    OP_READ  = 4,
+    OP_WRITE = 5   //a write past the end grows the file, up to INODE_BLOCK_NUM blocks
+};
+
+
+typedef struct {
+    uint32_t requestId;
+    uint32_t offset;
+    uint32_t length;      //bytes to read, payload bytes to write, or the file size for add
+    uint8_t  op;
+    uint8_t  nameLength;  //the name follows the header, then the write payload
+    uint16_t reserved;
+} RequestHeader;
+
+
+typedef struct {
+    uint32_t requestId;
+    int32_t  status;      //0 or -errno
+    uint32_t length;      //payload bytes that follow
+} ResponseHeader;
+
+
+typedef struct {
+    char     fileName[MAX_FILENAME_LENGTH];
+    uint64_t fileSize;
+} ListEntry;
+
+
+#define SERVER_MAX_EVENTS     256
+#define SERVER_READ_CHUNK     65536
+#define SERVER_OUTPUT_LIMIT   (8 * 1024 * 1024)
+
+
+typedef struct Connection {
+    int            fd;
+    uint32_t       events;
+    bool           closing;
+    bool           pending;
+    unsigned char* in;
+    size_t         inLength;
+    size_t         inCapacity;
+    unsigned char* out;
+    size_t         outLength;
+    size_t         outSent;
+    size_t         outCapacity;
+    struct Connection* prev;
+    struct Connection* next;
+} Connection;
+
+
+typedef struct {
+    int            epollFd;
+    int            listenFd;
+    bool           acceptPaused;   //out of descriptors, the listen fd is out of epoll
+    Inode          inodes[MAX_FILES];
+    unsigned char* bitmap;
+    bool           metadataDirty;
+    bool           dataDirty;
+    Connection*    connections;
+    Connection**   pending;
+    int            pendingCount;
+    int            pendingCapacity;
+    unsigned long  requests;
+    unsigned long  flushes;
+} Server;
+
+
+static volatile sig_atomic_t g_stopServer = 0;
+
+
+static void stopServer(int signum) {
+    (void)signum;
+    g_stopServer = 1;
+}
+
+
+static int reserveBuffer(unsigned char** buffer, size_t* capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    size_t newCapacity = *capacity ? *capacity : 4096;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    unsigned char* grown = (unsigned char*)realloc(*buffer, newCapacity);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = newCapacity;
+    return 0;
+}
+
+
+//appends a response header and returns where its payload goes, or NULL when out of memory
+static unsigned char* beginResponse(Connection* conn, uint32_t requestId, int32_t status, uint32_t length) {
+    if (reserveBuffer(&conn->out, &conn->outCapacity, conn->outLength + sizeof(ResponseHeader) + length) != 0) {
+        conn->closing = true;
+        return NULL;
+    }
+    ResponseHeader header = { requestId, status, length };
+    memcpy(conn->out + conn->outLength, &header, sizeof(header));
+    conn->outLength += sizeof(header) + length;
+    return conn->out + conn->outLength - length;
+}
+
+
+static int findInode(const Inode* inodes, const char* filename) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (inodes[i].isUsed && strcmp(inodes[i].fileName, filename) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+//bytes a write can fill before the file needs more blocks, where a packed file counts
+//the block its inline data or tail would otherwise have had
+static size_t fileCapacity(const Inode* inode) {
+    int blocks = inode->blocksAllocated + (inode->storage == STORAGE_BLOCKS ? 0 : 1);
+    return (size_t)blocks * g_superBlock.blockSize;
+}
+
+
+//what fits without moving a packed file: a tail may grow into the rest of its slots
+static size_t packedCapacity(const Inode* inode) {
+    if (inode->storage == STORAGE_INLINE) return INLINE_DATA_SIZE;
+    size_t wholeBytes = (size_t)inode->blocksAllocated * g_superBlock.blockSize;
+    if (inode->storage == STORAGE_TAIL) {
+        return wholeBytes + (size_t)fragmentSlots(tailLength(inode)) * FRAGMENT_ALIGN - sizeof(FragmentHeader);
+    }
+    return wholeBytes;
+}
+
+
+//reads or writes a byte range of a file, splitting it at block boundaries
+static int fileRangeIo(Inode* inode, bool isWrite, unsigned char* data, size_t offset, size_t length) {
+    if (inode->storage == STORAGE_INLINE) {
+        if (isWrite) memcpy(inode->inlineData + offset, data, length);
+        else memcpy(data, inode->inlineData + offset, length);
+        return 0;
+    }
+
+    size_t blockSize = g_superBlock.blockSize;
+    size_t wholeBytes = (size_t)inode->blocksAllocated * blockSize;
+    while (length > 0) {
+        size_t chunk;
+        IoRequest req;
+        req.isWrite = isWrite;
+        if (offset < wholeBytes) {
+            size_t within = offset % blockSize;
+            chunk = blockSize - within < length ? blockSize - within : length;
+            locateBlock(inode->blockIndex[offset / blockSize], &req.fd, &req.offset);
+            req.offset += within;
+        } else {
+            chunk = length;
+            locateTail(inode, &req.fd, &req.offset);
+            req.offset += sizeof(FragmentHeader) + (offset - wholeBytes);
+        }
+        req.iov.iov_base = data;
+        req.iov.iov_len  = chunk;
+        if (finishRequest(&req, 0) != 0) {
+            return -errno;
+        }
+        data += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+
+//space a file gets may still hold a deleted file's bytes, which reads of it must not return
+static int zeroFileRange(Inode* inode, size_t offset, size_t length) {
+    size_t blockSize = g_superBlock.blockSize;
+    unsigned char* zeros = (unsigned char*)calloc(1, blockSize);
+    if (zeros == NULL) {
+        return -ENOMEM;
+    }
+    int status = 0;
+    while (status == 0 && length > 0) {
+        size_t chunk = length < blockSize ? length : blockSize;
+        status = fileRangeIo(inode, true, zeros, offset, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    free(zeros);
+    return status;
+}
+
+
+//gives a file stored in whole blocks enough zeroed blocks to reach end
+static int growFile(Server* server, int inodeIndex, size_t end) {
+    Inode* inode = &server->inodes[inodeIndex];
+    size_t blockSize = g_superBlock.blockSize;
+    int oldBlocks = inode->blocksAllocated;
+    int newBlocks = (int)((end + blockSize - 1) / blockSize);
+    for (int i = 0; i < g_superBlock.blocksCount && inode->blocksAllocated < newBlocks; i++) {
+        if (!isBlockUsed(server->bitmap, i)) {
+            setBlockUsed(server->bitmap, i, true);
+            inode->blockIndex[inode->blocksAllocated++] = i;
+        }
+    }
+    int status = -ENOSPC;
+    if (inode->blocksAllocated == newBlocks) {
+        status = zeroFileRange(inode, (size_t)oldBlocks * blockSize, (size_t)(newBlocks - oldBlocks) * blockSize);
+    }
+    if (status != 0) {
+        while (inode->blocksAllocated > oldBlocks) {
+            inode->blocksAllocated--;
+            setBlockUsed(server->bitmap, inode->blockIndex[inode->blocksAllocated], false);
+            inode->blockIndex[inode->blocksAllocated] = 0;
+        }
+        return status;
+    }
+    server->dataDirty = true;
+    server->metadataDirty = true;
+    return 0;
+}
+
+
+//moves inline data or a packed tail into a whole block of its own
+static int unpackFile(Server* server, int inodeIndex) {
+    Inode* inode = &server->inodes[inodeIndex];
+    int block = -1;
+    for (int i = 0; i < g_superBlock.blocksCount && block == -1; i++) {
+        if (!isBlockUsed(server->bitmap, i)) block = i;
+    }
+    if (block == -1) {
+        return -ENOSPC;
+    }
+    unsigned char* data = (unsigned char*)calloc(1, g_superBlock.blockSize);
+    if (data == NULL) {
+        return -ENOMEM;
+    }
+    size_t wholeBytes = (size_t)inode->blocksAllocated * g_superBlock.blockSize;
+    int status = fileRangeIo(inode, false, data, wholeBytes, inode->fileSize - wholeBytes);
+    IoRequest req;
+    req.isWrite      = true;
+    req.iov.iov_base = data;
+    req.iov.iov_len  = g_superBlock.blockSize;
+    locateBlock(block, &req.fd, &req.offset);
+    if (status == 0 && finishRequest(&req, 0) != 0) {
+        status = -errno;
+    }
+    free(data);
+    if (status != 0) {
+        return status;
+    }
+
+    if (inode->storage == STORAGE_TAIL) {
+        releaseTail(server->inodes, inodeIndex, server->bitmap);
+    } else {
+        memset(inode->blockIndex, 0, sizeof(inode->blockIndex));
+    }
+    setBlockUsed(server->bitmap, block, true);
+    inode->blockIndex[inode->blocksAllocated++] = block;
+    inode->storage = STORAGE_BLOCKS;
+    inode->tailSlot = 0;
+    server->dataDirty = true;
+    server->metadataDirty = true;
+    return 0;
+}
+
+
+static void handleRequest(Server* server, Connection* conn, const RequestHeader* req,
+                          const char* name, unsigned char* payload) {
+    char fileName[MAX_FILENAME_LENGTH];
+    int status = 0;
+    server->requests++;
+
+    if (req->op != OP_LS) {
+        if (req->nameLength == 0 || req->nameLength >= MAX_FILENAME_LENGTH) {
+            beginResponse(conn, req->requestId, -ENAMETOOLONG, 0);
+            return;
+        }
+        memset(fileName, 0, sizeof(fileName));
+        memcpy(fileName, name, req->nameLength);
+    }
+
+    int inodeIndex = req->op == OP_LS ? -1 : findInode(server->inodes, fileName);
+    Inode* inode = inodeIndex >= 0 ? &server->inodes[inodeIndex] : NULL;
+
+    switch (req->op) {
+    case OP_LS: {
+        int count = 0;
+        for (int i = 0; i < MAX_FILES; i++) {
+            if (server->inodes[i].isUsed) count++;
+        }
+        unsigned char* data = beginResponse(conn, req->requestId, 0, count * sizeof(ListEntry));
+        for (int i = 0; data != NULL && i < MAX_FILES; i++) {
+            if (!server->inodes[i].isUsed) continue;
+            ListEntry entry;
+            memcpy(entry.fileName, server->inodes[i].fileName, MAX_FILENAME_LENGTH);
+            entry.fileSize = server->inodes[i].fileSize;
+            memcpy(data, &entry, sizeof(entry));
+            data += sizeof(entry);
+        }
+        return;
+    }
+    case OP_ADD: {
+        int freeIndex = -1;
+        for (int i = 0; i < MAX_FILES && freeIndex == -1; i++) {
+            if (!server->inodes[i].isUsed) freeIndex = i;
+        }
+        if (inode != NULL) {
+            status = -EEXIST;
+        } else if (freeIndex == -1) {
+            status = -ENOSPC;
+        } else {
+            status = allocateFileBlocks(server->inodes, freeIndex, server->bitmap, req->length);
+        }
+        if (status == 0) {
+            inode = &server->inodes[freeIndex];
+            strncpy(inode->fileName, fileName, MAX_FILENAME_LENGTH);
+            inode->fileSize = req->length;
+            inode->isUsed = true;
+            server->metadataDirty = true;
+            server->dataDirty = true;
+            status = zeroFileRange(inode, 0, packedCapacity(inode));
+            if (status == 0 && inode->storage == STORAGE_TAIL && writeFragmentHeader(server->inodes, freeIndex) != 0) {
+                status = -errno;
+            }
+            if (status != 0) {
+                releaseFileBlocks(server->inodes, freeIndex, server->bitmap);
+                deleteInode(inode);
+            }
+        }
+        break;
+    }
+    case OP_RM:
+        if (inode == NULL) {
+            status = -ENOENT;
+        } else {
+            releaseFileBlocks(server->inodes, inodeIndex, server->bitmap);
+            deleteInode(inode);
+            server->metadataDirty = true;
+        }
+        break;
+    case OP_READ: {
+        if (inode == NULL) {
+            status = -ENOENT;
+            break;
+        }
+        size_t length = req->offset < inode->fileSize ? inode->fileSize - req->offset : 0;
+        if (length > req->length) length = req->length;
+        size_t start = conn->outLength;
+        unsigned char* data = beginResponse(conn, req->requestId, 0, length);
+        if (data == NULL) return;
+        status = fileRangeIo(inode, false, data, req->offset, length);
+        if (status == 0) return;
+        conn->outLength = start;
+        break;
+    }
+    case OP_WRITE: {
+        size_t end = (size_t)req->offset + req->length;
+        if (inode == NULL) {
+            status = -ENOENT;
+        } else if (end > (size_t)INODE_BLOCK_NUM * g_superBlock.blockSize) {
+            status = -EFBIG;
+        } else {
+            if (end > packedCapacity(inode) && inode->storage != STORAGE_BLOCKS) {
+                status = unpackFile(server, inodeIndex);
+            }
+            if (status == 0 && end > fileCapacity(inode)) {
+                status = growFile(server, inodeIndex, end);
+            }
+            if (status == 0) {
+                status = fileRangeIo(inode, true, payload, req->offset, req->length);
+                server->dataDirty = true;
+            }
+        }
+        if (status == 0 && (end > inode->fileSize || inode->storage == STORAGE_INLINE)) {
+            if (end > inode->fileSize) {
+                inode->fileSize = end;
+                if (inode->storage == STORAGE_TAIL) {
+                    status = writeFragmentHeader(server->inodes, inodeIndex) == 0 ? 0 : -errno;
+                }
+            }
+            server->metadataDirty = true;
+        }
+        break;
+    }
+    default:
+        status = -EINVAL;
+        break;
+    }
+    beginResponse(conn, req->requestId, status, 0);
+}
+
+
+static void closeConnection(Server* server, Connection* conn);
+
 
-    int inodeIndex = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (inodes[i].isUsed && strcmp(inodes[i].fileName, newFilename) == 0) {
-            char response;
-            printf("File %s already exists. Overwrite? (y/n): ", newFilename);
-            scanf(" %c", &response);
-            if (response == 'y' || response == 'Y') {
-                inodeIndex = i;
-                break;
-            } else {
-                fclose(file);
-                fclose(fp);
-                printf("Operation cancelled\n");
-                return 0;
-            }
+//callers are done with conn when they call this, it may be closed here
+static void markPending(Server* server, Connection* conn) {
+    if (conn->pending) {
+        return;
+    }
+    if (server->pendingCount == server->pendingCapacity) {
+        int newCapacity = server->pendingCapacity ? server->pendingCapacity * 2 : 64;
+        Connection** grown = (Connection**)realloc(server->pending, newCapacity * sizeof(Connection*));
+        if (grown == NULL) {
+            //its replies could never be sent, so the client is told by closing instead
+            closeConnection(server, conn);
+            return;
         }
+        server->pending = grown;
+        server->pendingCapacity = newCapacity;
     }
+    conn->pending = true;
+    server->pending[server->pendingCount++] = conn;
+}
 
-    if (inodeIndex == -1) {
-        int result = addNewFile(diskName, newFilename, fileSize);
-        if (result != 0) {
-            fclose(file);
-            fclose(fp);
-            return result;
+
+static void processInput(Server* server, Connection* conn) {
+    size_t consumed = 0;
+    size_t maxPayload = (size_t)INODE_BLOCK_NUM * g_superBlock.blockSize;
+    while (!conn->closing && conn->inLength - consumed >= sizeof(RequestHeader)) {
+        RequestHeader req;
+        memcpy(&req, conn->in + consumed, sizeof(req));
+        size_t payloadLength = req.op == OP_WRITE ? req.length : 0;
+        if (payloadLength > maxPayload) {
+            conn->closing = true;
+            break;
         }
-        readInodeArea(inodes, MAX_FILES);
-        for (int i = 0; i < MAX_FILES; i++) {
-            if (inodes[i].isUsed && strcmp(inodes[i].fileName, newFilename) == 0) {
-                inodeIndex = i;
-                break;
+        size_t total = sizeof(req) + req.nameLength + payloadLength;
+        if (conn->inLength - consumed < total) {
+            if (reserveBuffer(&conn->in, &conn->inCapacity, conn->inLength - consumed + total) != 0) {
+                conn->closing = true;
             }
+            break;
         }
+        unsigned char* body = conn->in + consumed + sizeof(req);
+        handleRequest(server, conn, &req, (const char*)body, body + req.nameLength);
+        consumed += total;
     }
+    memmove(conn->in, conn->in + consumed, conn->inLength - consumed);
+    conn->inLength -= consumed;
+}
 
-    for (int i = 0; i < inodes[inodeIndex].blocksAllocated; i++) {
-        fseek(fp, sb.dataAreaOffset + inodes[inodeIndex].blockIndex[i] * sb.blockSize, SEEK_SET);
-        char* buffer = (char*)malloc(sb.blockSize);
-        if (buffer == NULL) {
-            perror("Failed to allocate buffer");
-            fclose(file);
-            fclose(fp);
-            return -1;
+
+static void readConnection(Server* server, Connection* conn) {
+    while (!conn->closing) {
+        if (reserveBuffer(&conn->in, &conn->inCapacity, conn->inLength + SERVER_READ_CHUNK) != 0) {
+            conn->closing = true;
+            break;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->inLength, SERVER_READ_CHUNK, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            conn->closing = true;
+            break;
         }
+        conn->inLength += n;
+        processInput(server, conn);
+        if (conn->outLength - conn->outSent >= SERVER_OUTPUT_LIMIT) break;
+    }
+    markPending(server, conn);
+}
 
-        size_t bytesRead = fread(buffer, 1, sizeof(buffer), file);
-        fwrite(buffer, 1, bytesRead, fp);
+
+static void closeConnection(Server* server, Connection* conn) {
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (server->acceptPaused) {
+        //a descriptor is free again, waiting clients can be let in
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->listenFd, &event) == 0) {
+            server->acceptPaused = false;
+        }
     }
+    if (conn->prev) conn->prev->next = conn->next;
+    else server->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
 
-    fclose(file);
-    fclose(fp);
-    return 0;
+
+static void acceptConnections(Server* server) {
+    for (;;) {
+        int fd = accept(server->listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                //the listen fd is level-triggered, leaving it in epoll would spin until a
+                //connection closes, so it sits out until then
+                static bool reported = false;
+                if (!reported) {
+                    printf("Out of file descriptors, new connections wait until one closes\n");
+                    fflush(stdout);
+                    reported = true;
+                }
+                epoll_ctl(server->epollFd, EPOLL_CTL_DEL, server->listenFd, NULL);
+                server->acceptPaused = true;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Failed to accept connection");
+            }
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        Connection* conn = (Connection*)calloc(1, sizeof(Connection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        struct epoll_event event;
+        event.events = conn->events;
+        event.data.ptr = conn;
+        if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->next = server->connections;
+        if (conn->next) conn->next->prev = conn;
+        server->connections = conn;
+    }
 }
 
 
-int copyFileFromVirtualDisk(const char* diskName, const char* filename) {
-    FILE *fp = fopen(diskName, "rb");
-    if (fp == NULL) {
-        perror("Failed to open virtual disk");
-        return -1;
+//sends what the connection has queued, then closes it or re-arms epoll for the rest
+static void flushConnection(Server* server, Connection* conn) {
+    conn->pending = false;
+    while (conn->outSent < conn->outLength) {
+        ssize_t n = send(conn->fd, conn->out + conn->outSent, conn->outLength - conn->outSent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) {
+            closeConnection(server, conn);
+            return;
+        }
+        conn->outSent += n;
+    }
+    if (conn->outSent == conn->outLength) {
+        conn->outSent = 0;
+        conn->outLength = 0;
+        if (conn->closing) {
+            closeConnection(server, conn);
+            return;
+        }
     }
 
-    g_diskFile = fp;
-    readSuperBlock();
-    SuperBlock sb = g_superBlock;
+    uint32_t events = 0;
+    if (!conn->closing && conn->outLength - conn->outSent < SERVER_OUTPUT_LIMIT) events |= EPOLLIN;
+    if (conn->outSent < conn->outLength) events |= EPOLLOUT;
+    if (events != conn->events) {
+        struct epoll_event event;
+        event.events = events;
+        event.data.ptr = conn;
+        epoll_ctl(server->epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = events;
+    }
+}
 
-    Inode inodes[MAX_FILES];
-    readInodeArea(inodes, MAX_FILES);
 
-    int inodeIndex = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (inodes[i].isUsed && strcmp(inodes[i].fileName, filename) == 0) {
-            inodeIndex = i;
-            break;
-        }
+//diskFd is the served image, the socket path must not name it
+static int openServerSocket(const char* socketPath, int diskFd) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        printf("Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    struct stat pathStat;
+    struct stat target;
+    struct stat diskStat;
+    bool exists = lstat(socketPath, &pathStat) == 0;
+    if (exists && stat(socketPath, &target) == 0 && fstat(diskFd, &diskStat) == 0
+        && target.st_dev == diskStat.st_dev && target.st_ino == diskStat.st_ino) {
+        printf("Socket path %s is the virtual disk itself\n", socketPath);
+        return -1;
     }
 
-    if (inodeIndex == -1) {
-        printf("File %s not found on the virtual disk\n", filename);
-        fclose(fp);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        //a socket nobody is listening on is left over from an earlier server,
+        //anything else at that path is never removed
+        bool isSocket = exists && S_ISSOCK(pathStat.st_mode);
+        int probe = errno == EADDRINUSE && isSocket ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+        bool stale = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno == ECONNREFUSED;
+        if (probe >= 0) close(probe);
+        if (!stale || unlink(socketPath) != 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            printf("Cannot bind socket %s\n", socketPath);
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        perror("Failed to listen on socket");
+        close(fd);
+        unlink(socketPath);
         return -1;
     }
+    return fd;
+}
 
-    char newFilename[MAX_FILENAME_LENGTH];
-    printf("Enter the name to save the file as: ");
-    scanf("%s", newFilename);
 
-    if (strlen(newFilename) >= MAX_FILENAME_LENGTH) {
-        printf("New filename is too long\n");
+int serveDisk(const char* diskName, const char* socketPath) {
+    FILE *fp = fopen(diskName, "rb+");
+    if (fp == NULL) {
+        perror("Failed to open virtual disk");
+        return -1;
+    }
+    if (lockDisk(fp, true) != 0) {
         fclose(fp);
         return -1;
     }
 
-    if (access(newFilename, F_OK) == 0) {
-        char response;
-        printf("File %s already exists. Overwrite? (y/n): ", newFilename);
-        scanf(" %c", &response);
-        if (response != 'y' && response != 'Y') {
-            fclose(fp);
-            printf("Operation cancelled\n");
-            return 0;
-        }
-    }
+    g_diskFile = fp;
+    readSuperBlock();
 
-    FILE *file = fopen(newFilename, "wb");
-    if (file == NULL) {
-        perror("Failed to open file");
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.bitmap = (unsigned char*)calloc(1, g_superBlock.bitmapSize);
+    if (server.bitmap == NULL) {
+        perror("Failed to allocate memory for bitmap");
+        fclose(fp);
+        return -1;
+    }
+    if (openMembers(true) != 0) {
+        free(server.bitmap);
         fclose(fp);
         return -1;
     }
+    readBitmap(server.bitmap, g_superBlock.bitmapSize);
+    readInodeArea(server.inodes, MAX_FILES);
+
+    //every client holds a descriptor, so take all the kernel allows this process
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
-    char* buffer = (char*)malloc(sb.blockSize);
-    if (buffer == NULL) {
-        perror("Failed to allocate buffer");
-        fclose(file);
+    int listenFd = openServerSocket(socketPath, fileno(fp));
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (listenFd < 0 || server.epollFd < 0) {
+        if (listenFd >= 0) {
+            close(listenFd);
+            unlink(socketPath);
+        }
+        closeMembers();
+        free(server.bitmap);
         fclose(fp);
         return -1;
     }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(server.epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    server.listenFd = listenFd;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving virtual disk %s on %s\n", diskName, socketPath);
+    fflush(stdout);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int result = 0;
+    while (!g_stopServer) {
+        int ready = epoll_wait(server.epollFd, events, SERVER_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            Connection* conn = (Connection*)events[i].data.ptr;
+            if (conn == NULL) {
+                acceptConnections(&server);
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                readConnection(&server, conn);
+            } else {
+                markPending(&server, conn);
+            }
+        }
 
-    size_t remainingBytes = inodes[inodeIndex].fileSize;
-    for (int i = 0; i < inodes[inodeIndex].blocksAllocated; i++) {
-        size_t bytesToRead = (remainingBytes < sb.blockSize) ? remainingBytes : sb.blockSize;
-        fseek(fp, sb.dataAreaOffset + inodes[inodeIndex].blockIndex[i] * sb.blockSize, SEEK_SET);
-        size_t bytesRead = fread(buffer, 1, bytesToRead, fp);
-        if (bytesRead != bytesToRead) {
-            printf("Error reading data from virtual disk\n");
-            free(buffer);
-            fclose(file);
-            fclose(fp);
-            return -1;
+        //one flush covers every change from this round of events, and no client
+        //hears about its change before it is on disk; data is synced ahead of the
+        //metadata that points at it. A failed flush leaves the disk in an unknown
+        //state, so the server stops without sending this round's replies
+        bool synced = true;
+        if (server.dataDirty) {
+            for (int m = 0; m < g_superBlock.memberCount && synced; m++) {
+                synced = fdatasync(g_memberFds[m]) == 0;
+            }
+            server.dataDirty = false;
         }
-        if (fwrite(buffer, 1, bytesRead, file) != bytesRead) {
-            printf("Error writing data to output file\n");
-            free(buffer);
-            fclose(file);
-            fclose(fp);
-            return -1;
+        if (server.metadataDirty && synced) {
+            synced = writeInodeArea(server.inodes, MAX_FILES) == 0 &&
+                     writeBitmap(server.bitmap, g_superBlock.bitmapSize) == 0 &&
+                     fdatasync(fileno(fp)) == 0;
+            server.metadataDirty = false;
+            if (synced) server.flushes++;
         }
-        remainingBytes -= bytesToRead;
+        if (!synced) {
+            perror("Failed to sync virtual disk");
+            printf("Stopping without acknowledging the unsynced requests\n");
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < server.pendingCount; i++) {
+            flushConnection(&server, server.pending[i]);
+        }
+        server.pendingCount = 0;
     }
 
-    free(buffer);
-    fclose(file);
+    while (server.connections) {
+        closeConnection(&server, server.connections);
+    }
+    close(listenFd);
+    unlink(socketPath);
+    close(server.epollFd);
+    free(server.pending);
+    free(server.bitmap);
+    closeMembers();
     fclose(fp);
 
-    printf("File %s copied from virtual disk %s and saved as %s\n", filename, diskName, newFilename);
-
-    return 0;
+    printf("Served %lu requests with %lu metadata flushes\n", server.requests, server.flushes);
+    return result;
 }
 
 
-int listFiles(const char *diskName) {
-    FILE *fp = fopen(diskName, "rb");
-    if (!fp) {
-        perror("Failed to open virtual disk");
-        return -1;
-    }
+//loadgen: pipelined clients against a running server, reporting throughput and latency
+#define LOADGEN_FILES      16
+#define LOADGEN_FILE_SIZE  4096
+#define LOADGEN_IO_SIZE    512
 
-    g_diskFile = fp;
-    readSuperBlock();
-    SuperBlock sb = g_superBlock;
 
-    Inode inodes[MAX_FILES];
-    readInodeArea(inodes, MAX_FILES);
+typedef struct {
+    int            fd;
+    int            sent;
+    int            received;
+    unsigned       seed;
+    double*        sentAt;
+    unsigned char* out;
+    size_t         outLength;
+    size_t         outSent;
+    size_t         outCapacity;
+    unsigned char* in;
+    size_t         inLength;
+    size_t         inCapacity;
+} LoadClient;
+
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    printf("Files on virtual disk %s:\n", diskName);
-    bool filesFound = false;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (inodes[i].isUsed) {
-            printf("File: %s, Size: %lu bytes\n", inodes[i].fileName, inodes[i].fileSize);
-            filesFound = true;
-        }
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+static int connectServer(const char* socketPath) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
     }
-    if (!filesFound) {
-        printf("No files on disk.\n");
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
     }
-    fclose(fp);
-    return 0;
+    return fd;
 }
 
-int showDiskUsage(const char* diskName) {
-    FILE *fp = fopen(diskName, "rb");
-    if (fp == NULL) {
-        perror("Failed to open virtual disk");
+
+static int appendRequest(unsigned char** out, size_t* outLength, size_t* capacity, uint32_t requestId, uint8_t op,
+                         const char* name, uint32_t offset, uint32_t length, const unsigned char* payload) {
+    RequestHeader req;
+    memset(&req, 0, sizeof(req));
+    req.requestId  = requestId;
+    req.op         = op;
+    req.nameLength = name ? strlen(name) : 0;
+    req.offset     = offset;
+    req.length     = length;
+    size_t payloadLength = op == OP_WRITE ? length : 0;
+    if (reserveBuffer(out, capacity, *outLength + sizeof(req) + req.nameLength + payloadLength) != 0) {
         return -1;
     }
+    memcpy(*out + *outLength, &req, sizeof(req));
+    *outLength += sizeof(req);
+    memcpy(*out + *outLength, name, req.nameLength);
+    *outLength += req.nameLength;
+    memcpy(*out + *outLength, payload, payloadLength);
+    *outLength += payloadLength;
+    return 0;
+}
 
-    g_diskFile = fp;
-    readSuperBlock();
-    SuperBlock sb = g_superBlock;
-
-    printf("Disk Memory Usage:\n");
 
-    unsigned char* bitmap = (unsigned char*)calloc(1, sb.bitmapSize);
-    if (bitmap == NULL) {
-        perror("Failed to allocate memory for bitmap");
-        fclose(fp);
-        return -1;
+//blocking round trip used for setup and cleanup
+static int simpleRequest(int fd, uint8_t op, const char* name, uint32_t length) {
+    unsigned char* out = NULL;
+    size_t outLength = 0;
+    size_t capacity = 0;
+    if (appendRequest(&out, &outLength, &capacity, 0, op, name, 0, length, NULL) != 0) {
+        return -ENOMEM;
     }
-    readBitmap(bitmap, sb.bitmapSize);
-    printBitmap((const char*)bitmap, sb.bitmapSize);
+    ssize_t n = send(fd, out, outLength, MSG_NOSIGNAL);
+    free(out);
+    ResponseHeader resp;
+    if (n != (ssize_t)outLength || recv(fd, &resp, sizeof(resp), MSG_WAITALL) != (ssize_t)sizeof(resp) || resp.length != 0) {
+        return -EIO;
+    }
+    return resp.status;
+}
 
-    free(bitmap);
-    fclose(fp);
 
-    return 0;
+static int queueLoadRequest(LoadClient* client, int index, const unsigned char* pattern) {
+    char name[MAX_FILENAME_LENGTH];
+    unsigned roll = rand_r(&client->seed) % 100;
+    uint32_t offset = (rand_r(&client->seed) % (LOADGEN_FILE_SIZE / LOADGEN_IO_SIZE)) * LOADGEN_IO_SIZE;
+    snprintf(name, sizeof(name), "lg%u", rand_r(&client->seed) % LOADGEN_FILES);
+    uint8_t op = OP_READ;
+    uint32_t length = LOADGEN_IO_SIZE;
+    if (roll >= 60 && roll < 90) {
+        op = OP_WRITE;
+    } else if (roll >= 90 && roll < 95) {
+        op = OP_LS;
+        length = 0;
+    } else if (roll >= 95) {
+        //metadata churn, errors from racing clients are expected
+        snprintf(name, sizeof(name), "lgt%u", client->seed % LOADGEN_FILES);
+        op = index % 2 ? OP_RM : OP_ADD;
+        length = op == OP_ADD ? LOADGEN_IO_SIZE : 0;
+        offset = 0;
+    }
+    return appendRequest(&client->out, &client->outLength, &client->outCapacity, index, op,
+                         op == OP_LS ? NULL : name, offset, length, pattern);
 }
 
 
-int removeVirtualDisk(const char* diskName) {
-    if (remove(diskName) == 0) {
-        printf("Virtual disk %s deleted successfully\n", diskName);
-        return 0;
-    } else {
-        perror("Failed to delete virtual disk");
+int runLoadGenerator(const char* socketPath, int connections, int requests, int depth) {
+    if (connections <= 0 || requests <= 0 || depth <= 0) {
+        printf("Connections, requests and pipeline depth must be positive\n");
         return -1;
     }
-}
+    signal(SIGPIPE, SIG_IGN);
 
+    int setupFd = connectServer(socketPath);
+    if (setupFd < 0) {
+        perror("Failed to connect to server");
+        return -1;
+    }
+    char name[MAX_FILENAME_LENGTH];
+    for (int i = 0; i < LOADGEN_FILES; i++) {
+        snprintf(name, sizeof(name), "lg%d", i);
+        int status = simpleRequest(setupFd, OP_ADD, name, LOADGEN_FILE_SIZE);
+        if (status != 0 && status != -EEXIST) {
+            printf("Failed to create %s on the server: %s\n", name, strerror(-status));
+            close(setupFd);
+            return -1;
+        }
+    }
 
-int defragmentDisk(const char* diskName) {
-    g_diskFile = fopen(diskName, "rb+");
-    if (!g_diskFile) {
-        printf("Failed to open virtual disk: %s\n", diskName);
-        return 1;
+    LoadClient* clients = (LoadClient*)calloc(connections, sizeof(LoadClient));
+    double* latencies = (double*)malloc((size_t)connections * requests * sizeof(double));
+    unsigned char pattern[LOADGEN_IO_SIZE];
+    memset(pattern, 0xA5, sizeof(pattern));
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (clients == NULL || latencies == NULL || epollFd < 0) {
+        perror("Failed to set up load generator");
+        free(clients);
+        free(latencies);
+        close(setupFd);
+        return -1;
     }
 
-    readSuperBlock();
+    int opened = 0;
+    for (; opened < connections; opened++) {
+        LoadClient* client = &clients[opened];
+        client->fd = connectServer(socketPath);
+        client->sentAt = (double*)malloc(depth * sizeof(double));
+        client->seed = 7919u * (opened + 1);
+        if (client->fd < 0 || client->sentAt == NULL) {
+            perror("Failed to open client connection");
+            break;
+        }
+        fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.ptr = client;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, client->fd, &event);
+    }
 
-    Inode inodes[MAX_FILES];
-    readInodeArea(inodes, MAX_FILES);
+    size_t completed = 0;
+    size_t failed = 0;
+    size_t total = (size_t)opened * requests;
+    int active = opened;
+    double start = nowSeconds();
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (opened == connections && active > 0) {
+        int ready = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int e = 0; e < ready; e++) {
+            LoadClient* client = (LoadClient*)events[e].data.ptr;
+            bool broken = false;
+
+            while (client->received < requests && reserveBuffer(&client->in, &client->inCapacity, client->inLength + SERVER_READ_CHUNK) == 0) {
+                ssize_t n = recv(client->fd, client->in + client->inLength, SERVER_READ_CHUNK, 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (n <= 0) {
+                    broken = true;
+                    break;
+                }
+                client->inLength += n;
+            }
+            size_t consumed = 0;
+            double now = nowSeconds();
+            while (client->inLength - consumed >= sizeof(ResponseHeader)) {
+                ResponseHeader resp;
+                memcpy(&resp, client->in + consumed, sizeof(resp));
+                if (client->inLength - consumed < sizeof(resp) + resp.length) break;
+                consumed += sizeof(resp) + resp.length;
+                latencies[completed++] = now - client->sentAt[client->received % depth];
+                if (resp.status != 0) failed++;
+                client->received++;
+            }
+            memmove(client->in, client->in + consumed, client->inLength - consumed);
+            client->inLength -= consumed;
 
-    unsigned char* bitmap = (unsigned char*)calloc(1, g_superBlock.bitmapSize);
-    readBitmap(bitmap, g_superBlock.bitmapSize);
+            while (client->sent < requests && client->sent - client->received < depth) {
+                if (queueLoadRequest(client, client->sent, pattern) != 0) {
+                    broken = true;
+                    break;
+                }
+                client->sentAt[client->sent % depth] = nowSeconds();
+                client->sent++;
+            }
+            while (!broken && client->outSent < client->outLength) {
+                ssize_t n = send(client->fd, client->out + client->outSent, client->outLength - client->outSent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (n < 0) {
+                    broken = true;
+                    break;
+                }
+                client->outSent += n;
+            }
+            if (client->outSent == client->outLength) {
+                client->outSent = 0;
+                client->outLength = 0;
+            }
 
-    int nextFreeBlock = 0; 
-    size_t block_size = g_superBlock.blockSize;
-    unsigned char* tempBlock = (unsigned char*)malloc(block_size);
-    int i;
-    int currentBlockIndex;
-    long oldBlockOffset;
-    long newBlockOffset;
-    int b;
-    unsigned char* swapBlock;
-    for (i = 0; i < MAX_FILES; i++) {
-        if (!inodes[i].isUsed) continue;
-        for (b = 0; b < inodes[i].blocksAllocated; b++) {
-            currentBlockIndex = inodes[i].blockIndex[b];
-            if (currentBlockIndex != nextFreeBlock) {
-                if (isBlockUsed(bitmap, nextFreeBlock)) {
-                    for (int k = 0; k < MAX_FILES; k++) {
-                        if (!inodes[k].isUsed) continue;
-                        for (int kk = 0; kk < inodes[k].blocksAllocated; kk++) {
-                            if (inodes[k].blockIndex[kk] == nextFreeBlock) {
-                                oldBlockOffset = g_superBlock.dataAreaOffset + 
-                                                      (long)currentBlockIndex * block_size;
-                                fseek(g_diskFile, oldBlockOffset, SEEK_SET);
-                                fread(tempBlock, 1, block_size, g_diskFile);
-                                swapBlock = (unsigned char*)malloc(block_size);
-                                newBlockOffset = g_superBlock.dataAreaOffset + 
-                                                      (long)nextFreeBlock * block_size;
-                                fseek(g_diskFile, newBlockOffset, SEEK_SET);
-                                fread(swapBlock, 1, block_size, g_diskFile);
-
-                                fseek(g_diskFile, oldBlockOffset, SEEK_SET);
-                                fwrite(swapBlock, 1, block_size, g_diskFile);
-
-                                fseek(g_diskFile, newBlockOffset, SEEK_SET);
-                                fwrite(tempBlock, 1, block_size, g_diskFile);
-                                fflush(g_diskFile);
-
-                                free(swapBlock);
-
-                                inodes[k].blockIndex[kk] = currentBlockIndex;
-                                inodes[i].blockIndex[b] = nextFreeBlock;
-
-                                writeInodeArea(inodes, MAX_FILES);
-
-                                break;
-                            }
-                        }
-                    }
-                } else {
-                    oldBlockOffset = g_superBlock.dataAreaOffset + 
-                                        (long)currentBlockIndex * block_size;
-                    fseek(g_diskFile, oldBlockOffset, SEEK_SET);
-                    fread(tempBlock, 1, block_size, g_diskFile);
-
-                    newBlockOffset = g_superBlock.dataAreaOffset + 
-                                          (long)nextFreeBlock * block_size;
-                    fseek(g_diskFile, newBlockOffset, SEEK_SET);
-                    fwrite(tempBlock, 1, block_size, g_diskFile);
-                    fflush(g_diskFile);
-
-                    inodes[i].blockIndex[b] = nextFreeBlock;
-                    
-                    setBlockUsed(bitmap, currentBlockIndex, false);
-                    setBlockUsed(bitmap, nextFreeBlock, true);
-
-                    writeBitmap(bitmap, g_superBlock.bitmapSize);
-                    writeInodeArea(inodes, MAX_FILES);
+            if (broken || client->received == requests) {
+                if (broken) {
+                    printf("Connection lost after %d responses\n", client->received);
+                    total -= requests - client->received;
                 }
+                //a server short of descriptors lets waiting clients in as others leave
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+                close(client->fd);
+                client->fd = -1;
+                active--;
+            } else {
+                struct epoll_event event;
+                event.events = EPOLLIN | (client->outLength ? EPOLLOUT : 0);
+                event.data.ptr = client;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, client->fd, &event);
             }
-            nextFreeBlock++;
         }
     }
+    double elapsed = nowSeconds() - start;
 
-    free(tempBlock);
-    free(bitmap);
+    for (int i = 0; i < connections; i++) {
+        if (clients[i].fd > 0) close(clients[i].fd);
+        free(clients[i].sentAt);
+        free(clients[i].in);
+        free(clients[i].out);
+    }
+    close(epollFd);
 
-    printf("Defragmentation completed.\n");
-    return 0;
+    for (int i = 0; i < LOADGEN_FILES; i++) {
+        snprintf(name, sizeof(name), "lg%d", i);
+        simpleRequest(setupFd, OP_RM, name, 0);
+        snprintf(name, sizeof(name), "lgt%d", i);
+        simpleRequest(setupFd, OP_RM, name, 0);
+    }
+    close(setupFd);
+
+    int result = (opened == connections && completed == total) ? 0 : -1;
+    if (completed > 0) {
+        qsort(latencies, completed, sizeof(double), compareDoubles);
+        printf("%zu requests over %d connections (pipeline depth %d) in %.3f s: %.0f ops/s\n",
+               completed, opened, depth, elapsed, completed / elapsed);
+        printf("Latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               latencies[completed / 2] * 1e6, latencies[completed * 99 / 100] * 1e6,
+               latencies[completed * 999 / 1000] * 1e6, latencies[completed - 1] * 1e6);
+        printf("%zu requests returned an error status\n", failed);
+    }
+    free(latencies);
+    free(clients);
+    return result;
 }
 
 
+
 int main(int argc, char *argv[]) {
     char *func = argv[2];
     unsigned int error = 0;
     char *diskName = argv[1];
     if (strcmp(argv[1], "create") == 0) {
-        if (argc != 5) {
-            fprintf(stderr, "create <disk name> <disk size> <block size>\n");
+        if (argc != 5 && argc < 7) {
+            fprintf(stderr, "create <disk name> <disk size> <block size> [<stripe unit> <member path>...]\n");
+            return 1;
+        }
+        if (argc == 5) {
+            error = createVirtualDisk(argv[2], atoi(argv[3]), atoi(argv[4]), 1, 0, NULL);
+        } else {
+            error = createVirtualDisk(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), argc - 6, argv + 6);
+        }
+    } else if (strcmp(argv[1], "loadgen") == 0) {
+        if (argc != 5 && argc != 6) {
+            fprintf(stderr, "loadgen <socket path> <connections> <requests per connection> [pipeline depth]\n");
             return 1;
         }
-        error = createVirtualDisk(argv[2], atoi(argv[3]), atoi(argv[4]));
+        error = runLoadGenerator(argv[2], atoi(argv[3]), atoi(argv[4]), argc == 6 ? atoi(argv[5]) : 16);
     } else if (strcmp(func, "cpin") == 0) {
         if (argc != 4) {
             fprintf(stderr, "<disk name> cpin <filename>\n");
@@ -762,6 +3224,18 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         error = showDiskUsage(diskName);
+    } else if (strcmp(func, "analyze") == 0) {
+        if (argc != 3 && (argc != 4 || strcmp(argv[3], "--json") != 0)) {
+            fprintf(stderr, "<disk name> analyze [--json]\n");
+            return 1;
+        }
+        error = analyzeDisk(diskName, argc == 4);
+    } else if (strcmp(func, "serve") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "<disk name> serve <socket path>\n");
+            return 1;
+        }
+        error = serveDisk(diskName, argv[3]);
     } else {
         fprintf(stderr, "Incorrect arguments format\n");
         return 1;
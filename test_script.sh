@@ -103,4 +103,197 @@ show_defragmentation() {
 show_defragmentation
 
 ./fs_util $VFS_NAME die
+echo ""
+
+
+# Copies a file back out of a disk and compares it with the original
+check_copy() {
+    rm -f test_out.bin
+    echo "test_out.bin" | ./fs_util $1 cpout $2 > /dev/null
+    cmp $3 test_out.bin
+    rm -f test_out.bin
+    echo "$2 matches $3"
+}
+
+
+defrag_past_end_test() {
+    echo "Defragmentation with files in the last blocks of an image that ends at the disk size"
+    echo ""
+    local disk="eof_disk.vfs"
+    ./fs_util create $disk $VFS_SIZE $BLOCK_SIZE > /dev/null
+    # images created before data area sizing stop at the disk size, short of the last blocks
+    truncate -s $VFS_SIZE $disk
+    for n in $(seq 1 50); do
+        ./fs_util $disk add a$n 8192 > /dev/null
+    done
+    ./fs_util $disk rm a2 > /dev/null
+    head -c 8192 /dev/urandom > test_k.bin
+    echo "k" | ./fs_util $disk cpin test_k.bin > /dev/null
+    ./fs_util $disk rm a1 > /dev/null
+    ./fs_util $disk rm a3 > /dev/null
+    ./fs_util $disk defrag
+    check_copy $disk k test_k.bin
+    ./fs_util $disk die > /dev/null
+    rm -f test_k.bin
+    echo ""
+}
+
+defrag_past_end_test
+
+
+serve_test() {
+    echo "Serving a disk to pipelined clients over a Unix socket"
+    echo ""
+    local disk="served_disk.vfs"
+    local socket="test_serve.sock"
+    ./fs_util create $disk $VFS_SIZE $BLOCK_SIZE > /dev/null
+    head -c 3000 /dev/urandom > test_v.bin
+    echo "v" | ./fs_util $disk cpin test_v.bin > /dev/null
+    ./fs_util $disk serve $socket &
+    local server=$!
+    for n in $(seq 1 50); do
+        [ -S $socket ] && break
+        sleep 0.1
+    done
+    # the server holds the disk lock for as long as it runs
+    ./fs_util $disk ls | grep "in use by another process"
+    ./fs_util loadgen $socket 4 50 2
+    kill -INT $server
+    wait $server
+    if [ -e $socket ]; then
+        echo "Socket was not removed"
+        exit 1
+    fi
+    ./fs_util $disk ls | grep -c "^File:" | grep -x 1
+    check_copy $disk v test_v.bin
+    ./fs_util $disk die > /dev/null
+    rm -f test_v.bin
+    echo ""
+}
+
+serve_test
+
+
+analyze_test() {
+    echo "Free space and file layout analysis of a known layout"
+    echo ""
+    local disk="analyzed_disk.vfs"
+    ./fs_util create $disk $VFS_SIZE $BLOCK_SIZE > /dev/null
+    for n in $(seq 1 7); do
+        ./fs_util $disk add f$n $BLOCK_SIZE > /dev/null
+    done
+    ./fs_util $disk add g $(expr $BLOCK_SIZE \* 3) > /dev/null
+    ./fs_util $disk add h $BLOCK_SIZE > /dev/null
+    # leaves free runs of 1 block at 1, 3 blocks at 7 and the rest of the disk from 11
+    ./fs_util $disk rm f2 > /dev/null
+    ./fs_util $disk rm g > /dev/null
+    ./fs_util $disk analyze > test_analyze.txt
+    grep -x "Used: 7 blocks, Free: 793 blocks in 3 runs" test_analyze.txt
+    grep -x "Largest free run: 789 blocks starting at block 11" test_analyze.txt
+    grep -E "^ +1 - 1 +runs: 1 +blocks: 1$" test_analyze.txt
+    grep -E "^ +2 - 3 +runs: 1 +blocks: 3$" test_analyze.txt
+    grep -E "^ +512 - 1023 +runs: 1 +blocks: 789$" test_analyze.txt
+
+    echo ""
+    echo "A file placed first fit over those runs has three extents"
+    ./fs_util $disk add k $(expr $BLOCK_SIZE \* 5) > /dev/null
+    ./fs_util $disk analyze | grep "File: k, Storage: blocks, Blocks: 5, Extents: 3,"
+    ./fs_util $disk analyze --json > test_analyze.json
+    python3 -c '
+import json, sys
+report = json.load(open(sys.argv[1]))
+assert report["blocks"] == 800 and report["usedBlocks"] == 12 and report["freeRuns"] == 1
+assert report["largestFreeRun"] == {"start": 12, "length": 788}
+assert report["freeRunHistogram"] == [{"minLength": 512, "maxLength": 1023, "runs": 1, "blocks": 788}]
+k = [f for f in report["files"] if f["name"] == "k"][0]
+assert k["blocks"] == 5 and k["extents"] == 3 and k["storage"] == "blocks"
+' test_analyze.json
+    echo "analyze --json matches the layout"
+    ./fs_util $disk die > /dev/null
+    rm -f test_analyze.txt test_analyze.json
+    echo ""
+}
+
+analyze_test
+
+
+striping_test() {
+    echo "Striping data over the disk file and two member files"
+    echo ""
+    local disk="striped_disk.vfs"
+    mkdir -p test_members test_elsewhere
+    ./fs_util create $disk $VFS_SIZE $BLOCK_SIZE 2 test_members/member1.img test_members/member2.img
+    head -c 7000 /dev/urandom > test_s1.bin
+    head -c 3000 /dev/urandom > test_s2.bin
+    echo "s1" | ./fs_util $disk cpin test_s1.bin > /dev/null
+    echo "s2" | ./fs_util $disk cpin test_s2.bin > /dev/null
+    check_copy $disk s1 test_s1.bin
+    ./fs_util $disk rm s1 > /dev/null
+    ./fs_util $disk defrag
+    # member paths are stored resolved, so the disk works from any directory
+    (cd test_elsewhere && echo "test_out.bin" | ../fs_util ../$disk cpout s2 > /dev/null)
+    cmp test_s2.bin test_elsewhere/test_out.bin
+    rm -f test_elsewhere/test_out.bin
+    echo "s2 read from another directory matches test_s2.bin"
+    ./fs_util $disk die
+    if [ -e test_members/member1.img ] || [ -e test_members/member2.img ]; then
+        echo "Stripe members were not removed"
+        exit 1
+    fi
+    rmdir test_members test_elsewhere
+    rm -f test_s1.bin test_s2.bin
+    echo ""
+}
+
+striping_test
+
+
+small_files_test() {
+    echo "Inline files and tails packed into a shared fragment block"
+    echo ""
+    local disk="packed_disk.vfs"
+    export VFS_PACK_SMALL_FILES=1
+    ./fs_util create $disk $VFS_SIZE $BLOCK_SIZE > /dev/null
+    head -c 40 /dev/urandom > test_i.bin
+    head -c 1024 /dev/urandom > test_x.bin
+    head -c 1124 /dev/urandom > test_y.bin
+    head -c 2098 /dev/urandom > test_z.bin
+    echo "i" | ./fs_util $disk cpin test_i.bin > /dev/null
+    echo "x" | ./fs_util $disk cpin test_x.bin > /dev/null
+    echo "y" | ./fs_util $disk cpin test_y.bin > /dev/null
+    ./fs_util $disk rm x > /dev/null
+    # z takes the blocks x left and blocks past y, its tail joins y's in the fragment block
+    echo "z" | ./fs_util $disk cpin test_z.bin > /dev/null
+    ./fs_util $disk analyze | grep "^Inline files: 1, Packed tails: 2 in 1 fragment blocks"
+    check_copy $disk i test_i.bin
+    check_copy $disk y test_y.bin
+    check_copy $disk z test_z.bin
+
+    echo ""
+    echo "Packing z in front of y moves the blocks and the fragment block in one cycle"
+    for round in 1 2; do
+        ./fs_util $disk defrag
+        check_copy $disk i test_i.bin
+        check_copy $disk y test_y.bin
+        check_copy $disk z test_z.bin
+    done
+    if ./fs_util $disk analyze | grep "disagree"; then
+        exit 1
+    fi
+
+    echo ""
+    echo "The fragment block is freed with the last tail in it"
+    ./fs_util $disk rm y > /dev/null
+    ./fs_util $disk analyze | grep "^Inline files: 1, Packed tails: 1 in 1 fragment blocks"
+    check_copy $disk z test_z.bin
+    ./fs_util $disk rm z > /dev/null
+    ./fs_util $disk analyze | grep "^Used: 0 blocks"
+    check_copy $disk i test_i.bin
+    ./fs_util $disk die > /dev/null
+    rm -f test_i.bin test_x.bin test_y.bin test_z.bin
+    echo ""
+}
+
+small_files_test
+
 echo "All tests completed successfully."
\ No newline at end of file